@@ -0,0 +1,712 @@
+#include "apu.h"
+#include "cpu.h"
+#include "pacer.h"
+#include "savestate.h"
+
+static const uint8_t LENGTH_TABLE[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t DUTY_TABLE[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1}
+};
+
+// NTSC periods in CPU cycles
+static const uint16_t NOISE_PERIODS[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t DMC_RATES[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Frame counter steps in CPU cycles after a $4017 write, and the sequence
+// length. The 4-step sequence raises the frame IRQ on its last step.
+static const uint32_t FOUR_STEP[4] = {7457, 14913, 22371, 29829};
+static const uint32_t FOUR_STEP_LENGTH = 29830;
+static const uint32_t FIVE_STEP[5] = {7457, 14913, 22371, 29829, 37281};
+static const uint32_t FIVE_STEP_LENGTH = 37282;
+
+// mixer output is 0.0-1.0, leave some headroom for filter overshoot
+static const float OUTPUT_SCALE = 30000.0f;
+
+void Envelope::clock() {
+    if (start) {
+        start = false;
+        decay = 15;
+        divider = volume;
+    }
+    else if (divider == 0) {
+        divider = volume;
+        if (decay > 0) {
+            decay--;
+        }
+        else if (loop) {
+            decay = 15;
+        }
+    }
+    else {
+        divider--;
+    }
+}
+
+uint16_t Pulse::sweep_target() const {
+    int change = period >> sweep_shift;
+    if (sweep_negate) {
+        int target = period - change - (ones_complement ? 1 : 0);
+        return (uint16_t)(target < 0 ? 0 : target);
+    }
+    return (uint16_t)(period + change);
+}
+
+void Pulse::clock_sweep() {
+    if (sweep_divider == 0 && sweep_enabled && sweep_shift > 0 && !muted()) {
+        period = sweep_target();
+    }
+    if (sweep_divider == 0 || sweep_reload) {
+        sweep_divider = sweep_period;
+        sweep_reload = false;
+    }
+    else {
+        sweep_divider--;
+    }
+}
+
+// Run the timer without looking at the output, for a silent channel
+void Pulse::skip(uint32_t cycles) {
+    if (cycles < counter) {
+        counter -= cycles;
+        return;
+    }
+    cycles -= counter;
+    uint32_t period_cycles = step_cycles();
+    sequence = (sequence + 1 + cycles / period_cycles) & 7;
+    counter = period_cycles - cycles % period_cycles;
+}
+
+uint8_t Pulse::output() const {
+    if (!audible() || !DUTY_TABLE[duty][sequence]) {
+        return 0;
+    }
+    return envelope.output();
+}
+
+void Triangle::clock_linear() {
+    if (linear_reload) {
+        linear = linear_reload_value;
+    }
+    else if (linear > 0) {
+        linear--;
+    }
+    if (!control) {
+        linear_reload = false;
+    }
+}
+
+uint8_t Triangle::output() const {
+    return (sequence < 16) ? (15 - sequence) : (sequence - 16);
+}
+
+uint32_t Noise::step_cycles() const {
+    return NOISE_PERIODS[period_index];
+}
+
+void Noise::step() {
+    uint16_t feedback = (shift ^ (shift >> (mode ? 6 : 1))) & 1;
+    shift = (shift >> 1) | (feedback << 14);
+}
+
+void Noise::skip(uint32_t cycles) {
+    while (cycles >= counter) {
+        cycles -= counter;
+        counter = step_cycles();
+        step();
+    }
+    counter -= cycles;
+}
+
+uint8_t Noise::output() const {
+    if (!audible() || (shift & 1)) {
+        return 0;
+    }
+    return envelope.output();
+}
+
+uint32_t DMC::step_cycles() const {
+    return DMC_RATES[rate_index];
+}
+
+void DMC::restart() {
+    current_address = sample_address;
+    bytes_remaining = sample_length;
+}
+
+APU::APU() : cpu(nullptr), muted(false), ring(16384) {
+    // nonlinear mixer from the nesdev wiki, as lookup tables
+    pulse_table[0] = 0.0f;
+    for (int n = 1; n < 31; n++) {
+        pulse_table[n] = (float)(95.52 / (8128.0 / n + 100.0));
+    }
+    tnd_table[0] = 0.0f;
+    for (int n = 1; n < 203; n++) {
+        tnd_table[n] = (float)(163.67 / (24329.0 / n + 100.0));
+    }
+    reset();
+}
+
+void APU::connectCPU(CPU* cpu_ref) {
+    cpu = cpu_ref;
+}
+
+// 0 leaves output off, the channels still run for $4015 and IRQs
+void APU::set_sample_rate(int rate) {
+    if (rate > 0) {
+        blip.set_rates(NES_CPU_CLOCK_HZ, rate);
+        filter.set_rate(rate);
+    }
+    mixed.resize(rate > 0 ? rate / 10 : 0);
+    samples.resize(mixed.size());
+}
+
+void APU::set_rate_ratio(double ratio) {
+    blip.set_rate_scale(ratio);
+}
+
+void APU::set_quality(int taps) {
+    blip.set_quality(taps);
+}
+
+void APU::set_filter(AudioFilter mode) {
+    filter.set_mode(mode);
+}
+
+void APU::set_muted(bool mute) {
+    muted = mute;
+}
+
+void APU::reset() {
+    pulse[0] = Pulse();
+    pulse[1] = Pulse();
+    pulse[0].ones_complement = true;
+    triangle = Triangle();
+    noise = Noise();
+    noise.shift = 1;
+    dmc = DMC();
+    dmc.sample_address = 0xC000;
+    dmc.sample_length = 1;
+    dmc.bits_remaining = 8;
+    dmc.silence = true;
+
+    pulse[0].counter = pulse[0].step_cycles();
+    pulse[1].counter = pulse[1].step_cycles();
+    triangle.counter = triangle.step_cycles();
+    noise.counter = noise.step_cycles();
+    dmc.counter = dmc.step_cycles();
+
+    five_step = false;
+    irq_inhibit = false;
+    frame_irq = false;
+    dmc_irq = false;
+    frame_step = 0;
+    frame_counter = FOUR_STEP[0];
+
+    time = 0;
+    frame_start = 0;
+    writes.clear();
+    mix_level = 0.0f;
+    blip.clear();
+    filter.reset();
+    predict_irq();
+}
+
+void APU::write_register(uint16_t addr, uint8_t value, uint64_t cycle) {
+    writes.push_back({cycle, addr, value});
+
+    // these change what the CPU can see (IRQ sources and the $4015 length
+    // bits), so they can't wait for the end of the frame
+    if (addr == 0x4010 || addr == 0x4015 || addr == 0x4017 || writes.size() >= 4096) {
+        run_until(cycle);
+    }
+}
+
+uint8_t APU::read_status(uint64_t cycle) {
+    run_until(cycle);
+
+    uint8_t status = 0;
+    if (pulse[0].length > 0) status |= 0x01;
+    if (pulse[1].length > 0) status |= 0x02;
+    if (triangle.length > 0) status |= 0x04;
+    if (noise.length > 0) status |= 0x08;
+    if (dmc.bytes_remaining > 0) status |= 0x10;
+    if (frame_irq) status |= 0x40;
+    if (dmc_irq) status |= 0x80;
+
+    frame_irq = false; // reading acknowledges the frame IRQ
+    return status;
+}
+
+bool APU::irq_catch_up(uint64_t cycle) {
+    if (!frame_irq && !dmc_irq) {
+        run_until(cycle);
+    }
+    return frame_irq || dmc_irq;
+}
+
+void APU::end_frame(uint64_t cycle) {
+    run_until(cycle);
+    if (muted) {
+        // the muted span is cut out of the output, the buffer never sees it
+        frame_start = cycle;
+        return;
+    }
+    blip.end_frame((uint32_t)(cycle - frame_start));
+    frame_start = cycle;
+
+    // the whole frame goes through each stage in one pass
+    int count;
+    while (!mixed.empty() && (count = blip.read_samples(mixed.data(), (int)mixed.size())) > 0) {
+        filter.process(mixed.data(), count);
+        convert_to_int16(mixed.data(), samples.data(), count, OUTPUT_SCALE);
+        ring.write(samples.data(), count);
+    }
+}
+
+AudioRing& APU::output() {
+    return ring;
+}
+
+void APU::save_state(StateWriter& w) const {
+    w.begin_chunk(state_tag("APU "), 1);
+    w.put(pulse[0]);
+    w.put(pulse[1]);
+    w.put(triangle);
+    w.put(noise);
+    w.put(dmc);
+    w.put(five_step);
+    w.put(irq_inhibit);
+    w.put(frame_irq);
+    w.put(dmc_irq);
+    w.put(frame_step);
+    w.put(frame_counter);
+    w.put(time);
+    w.put((uint32_t)writes.size());
+    for (const Write& write : writes) {
+        w.put(write.cycle);
+        w.put(write.addr);
+        w.put(write.value);
+    }
+    w.end_chunk();
+}
+
+bool APU::load_state(StateReader& r) {
+    uint16_t version;
+    if (!r.open_chunk(state_tag("APU "), version) || version != 1) {
+        return false;
+    }
+    r.get(pulse[0]);
+    r.get(pulse[1]);
+    r.get(triangle);
+    r.get(noise);
+    r.get(dmc);
+    r.get(five_step);
+    r.get(irq_inhibit);
+    r.get(frame_irq);
+    r.get(dmc_irq);
+    r.get(frame_step);
+    r.get(frame_counter);
+    r.get(time);
+    uint32_t count = 0;
+    r.get(count);
+    writes.clear();
+    for (uint32_t i = 0; i < count && r.ok(); i++) {
+        Write write;
+        r.get(write.cycle);
+        r.get(write.addr);
+        r.get(write.value);
+        writes.push_back(write);
+    }
+    if (!r.ok()) {
+        return false;
+    }
+
+    // the buffer keeps what it has, the restored channels continue from
+    // where its current frame starts
+    frame_start = time;
+    update_output();
+    predict_irq();
+    return true;
+}
+
+void APU::copy_state_from(const APU& other) {
+    pulse[0] = other.pulse[0];
+    pulse[1] = other.pulse[1];
+    triangle = other.triangle;
+    noise = other.noise;
+    dmc = other.dmc;
+    five_step = other.five_step;
+    irq_inhibit = other.irq_inhibit;
+    frame_irq = other.frame_irq;
+    dmc_irq = other.dmc_irq;
+    frame_step = other.frame_step;
+    frame_counter = other.frame_counter;
+    time = other.time;
+    writes = other.writes;
+
+    frame_start = time;
+    update_output();
+    predict_irq();
+}
+
+// Apply the queued writes and run the channels up to cycle, stopping at
+// every write and frame counter step on the way
+void APU::run_until(uint64_t cycle) {
+    size_t next_write = 0;
+    while (true) {
+        uint64_t target = cycle;
+        bool write_due = next_write < writes.size() && writes[next_write].cycle <= cycle;
+        if (write_due) {
+            target = (writes[next_write].cycle > time) ? writes[next_write].cycle : time;
+        }
+        bool frame_due = (time + frame_counter) <= target;
+        if (frame_due) {
+            target = time + frame_counter;
+        }
+        if (target > time) {
+            synthesize((uint32_t)(target - time));
+        }
+
+        if (frame_due) {
+            clock_frame_counter();
+        }
+        else if (write_due) {
+            apply_write(writes[next_write].addr, writes[next_write].value);
+            next_write++;
+        }
+        else {
+            break;
+        }
+        update_output();
+    }
+    writes.erase(writes.begin(), writes.begin() + next_write);
+    predict_irq();
+}
+
+// Advance every channel by cycles with no writes or frame counter steps in
+// between. Only channels that can be heard cut the span into pieces, the
+// rest jump straight to the end.
+void APU::synthesize(uint32_t cycles) {
+    bool pulse0 = pulse[0].audible();
+    bool pulse1 = pulse[1].audible();
+    bool tri = triangle.stepping();
+    bool noi = noise.audible();
+
+    uint32_t left = cycles;
+    while (left > 0) {
+        uint32_t step = left;
+        if (pulse0 && pulse[0].counter < step) step = pulse[0].counter;
+        if (pulse1 && pulse[1].counter < step) step = pulse[1].counter;
+        if (tri && triangle.counter < step) step = triangle.counter;
+        if (noi && noise.counter < step) step = noise.counter;
+        if (dmc.counter < step) step = dmc.counter;
+
+        for (int i = 0; i < 2; i++) {
+            if ((i == 0) ? pulse0 : pulse1) {
+                pulse[i].counter -= step;
+                if (pulse[i].counter == 0) {
+                    pulse[i].counter = pulse[i].step_cycles();
+                    pulse[i].sequence = (pulse[i].sequence + 1) & 7;
+                }
+            }
+        }
+        if (tri) {
+            triangle.counter -= step;
+            if (triangle.counter == 0) {
+                triangle.counter = triangle.step_cycles();
+                triangle.sequence = (triangle.sequence + 1) & 31;
+            }
+        }
+        if (noi) {
+            noise.counter -= step;
+            if (noise.counter == 0) {
+                noise.counter = noise.step_cycles();
+                noise.step();
+            }
+        }
+        dmc.counter -= step;
+        if (dmc.counter == 0) {
+            dmc.counter = dmc.step_cycles();
+            dmc_step();
+        }
+
+        time += step;
+        frame_counter -= step;
+        left -= step;
+        update_output();
+    }
+
+    if (!pulse0) pulse[0].skip(cycles);
+    if (!pulse1) pulse[1].skip(cycles);
+    if (!noi) noise.skip(cycles);
+}
+
+void APU::apply_write(uint16_t addr, uint8_t value) {
+    switch (addr) {
+        case 0x4000:
+        case 0x4004: {
+            Pulse& p = pulse[(addr >> 2) & 1];
+            p.duty = value >> 6;
+            p.envelope.loop = (value & 0x20) != 0;
+            p.envelope.constant = (value & 0x10) != 0;
+            p.envelope.volume = value & 0x0F;
+            break;
+        }
+        case 0x4001:
+        case 0x4005: {
+            Pulse& p = pulse[(addr >> 2) & 1];
+            p.sweep_enabled = (value & 0x80) != 0;
+            p.sweep_period = (value >> 4) & 7;
+            p.sweep_negate = (value & 0x08) != 0;
+            p.sweep_shift = value & 7;
+            p.sweep_reload = true;
+            break;
+        }
+        case 0x4002:
+        case 0x4006: {
+            Pulse& p = pulse[(addr >> 2) & 1];
+            p.period = (p.period & 0x0700) | value;
+            break;
+        }
+        case 0x4003:
+        case 0x4007: {
+            Pulse& p = pulse[(addr >> 2) & 1];
+            p.period = (p.period & 0x00FF) | ((value & 7) << 8);
+            if (p.enabled) {
+                p.length = LENGTH_TABLE[value >> 3];
+            }
+            p.sequence = 0;
+            p.envelope.start = true;
+            break;
+        }
+        case 0x4008:
+            triangle.control = (value & 0x80) != 0;
+            triangle.linear_reload_value = value & 0x7F;
+            break;
+        case 0x400A:
+            triangle.period = (triangle.period & 0x0700) | value;
+            break;
+        case 0x400B:
+            triangle.period = (triangle.period & 0x00FF) | ((value & 7) << 8);
+            if (triangle.enabled) {
+                triangle.length = LENGTH_TABLE[value >> 3];
+            }
+            triangle.linear_reload = true;
+            break;
+        case 0x400C:
+            noise.envelope.loop = (value & 0x20) != 0;
+            noise.envelope.constant = (value & 0x10) != 0;
+            noise.envelope.volume = value & 0x0F;
+            break;
+        case 0x400E:
+            noise.mode = (value & 0x80) != 0;
+            noise.period_index = value & 0x0F;
+            break;
+        case 0x400F:
+            if (noise.enabled) {
+                noise.length = LENGTH_TABLE[value >> 3];
+            }
+            noise.envelope.start = true;
+            break;
+        case 0x4010:
+            dmc.irq_enabled = (value & 0x80) != 0;
+            if (!dmc.irq_enabled) {
+                dmc_irq = false;
+            }
+            dmc.loop = (value & 0x40) != 0;
+            dmc.rate_index = value & 0x0F;
+            break;
+        case 0x4011:
+            dmc.level = value & 0x7F;
+            break;
+        case 0x4012:
+            dmc.sample_address = 0xC000 + value * 64;
+            break;
+        case 0x4013:
+            dmc.sample_length = value * 16 + 1;
+            break;
+        case 0x4015:
+            pulse[0].enabled = (value & 0x01) != 0;
+            pulse[1].enabled = (value & 0x02) != 0;
+            triangle.enabled = (value & 0x04) != 0;
+            noise.enabled = (value & 0x08) != 0;
+            if (!pulse[0].enabled) pulse[0].length = 0;
+            if (!pulse[1].enabled) pulse[1].length = 0;
+            if (!triangle.enabled) triangle.length = 0;
+            if (!noise.enabled) noise.length = 0;
+
+            if (!(value & 0x10)) {
+                dmc.bytes_remaining = 0;
+            }
+            else if (dmc.bytes_remaining == 0) {
+                dmc.restart();
+                dmc_fetch();
+            }
+            dmc_irq = false;
+            break;
+        case 0x4017:
+            five_step = (value & 0x80) != 0;
+            irq_inhibit = (value & 0x40) != 0;
+            if (irq_inhibit) {
+                frame_irq = false;
+            }
+            frame_step = 0;
+            frame_counter = FOUR_STEP[0]; // same first step in both modes
+            if (five_step) {
+                quarter_frame();
+                half_frame();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void APU::clock_frame_counter() {
+    const uint32_t* steps = five_step ? FIVE_STEP : FOUR_STEP;
+    int count = five_step ? 5 : 4;
+    uint32_t length = five_step ? FIVE_STEP_LENGTH : FOUR_STEP_LENGTH;
+
+    if (five_step) {
+        if (frame_step != 3) {
+            quarter_frame();
+        }
+        if (frame_step == 1 || frame_step == 4) {
+            half_frame();
+        }
+    }
+    else {
+        quarter_frame();
+        if (frame_step == 1 || frame_step == 3) {
+            half_frame();
+        }
+        if (frame_step == 3 && !irq_inhibit) {
+            frame_irq = true;
+        }
+    }
+
+    if (frame_step + 1 < count) {
+        frame_counter = steps[frame_step + 1] - steps[frame_step];
+        frame_step++;
+    }
+    else {
+        frame_counter = length - steps[frame_step] + steps[0];
+        frame_step = 0;
+    }
+}
+
+void APU::quarter_frame() {
+    pulse[0].envelope.clock();
+    pulse[1].envelope.clock();
+    noise.envelope.clock();
+    triangle.clock_linear();
+}
+
+void APU::half_frame() {
+    for (int i = 0; i < 2; i++) {
+        if (!pulse[i].envelope.loop && pulse[i].length > 0) {
+            pulse[i].length--;
+        }
+        pulse[i].clock_sweep();
+    }
+    if (!triangle.control && triangle.length > 0) {
+        triangle.length--;
+    }
+    if (!noise.envelope.loop && noise.length > 0) {
+        noise.length--;
+    }
+}
+
+// One output clock of the DMC: move the level by the next bit and start a
+// new byte every 8 bits
+void APU::dmc_step() {
+    if (!dmc.silence) {
+        if (dmc.shift & 1) {
+            if (dmc.level <= 125) dmc.level += 2;
+        }
+        else {
+            if (dmc.level >= 2) dmc.level -= 2;
+        }
+        dmc.shift >>= 1;
+    }
+
+    dmc.bits_remaining--;
+    if (dmc.bits_remaining == 0) {
+        dmc.bits_remaining = 8;
+        if (dmc.buffer_full) {
+            dmc.silence = false;
+            dmc.shift = dmc.buffer;
+            dmc.buffer_full = false;
+            dmc_fetch();
+        }
+        else {
+            dmc.silence = true;
+        }
+    }
+}
+
+// Refill the sample buffer. The read goes through the mapper's current
+// banks, not the ones at the exact cycle, which only matters for games that
+// bank switch under a playing sample.
+void APU::dmc_fetch() {
+    if (dmc.buffer_full || dmc.bytes_remaining == 0) {
+        return;
+    }
+    dmc.buffer = cpu ? cpu->read(dmc.current_address) : 0;
+    dmc.buffer_full = true;
+    dmc.current_address = (dmc.current_address == 0xFFFF) ? 0x8000 : dmc.current_address + 1;
+    dmc.bytes_remaining--;
+
+    if (dmc.bytes_remaining == 0) {
+        if (dmc.loop) {
+            dmc.restart();
+        }
+        else if (dmc.irq_enabled) {
+            dmc_irq = true;
+        }
+    }
+}
+
+void APU::update_output() {
+    if (muted) {
+        return;
+    }
+    uint8_t tri = triangle.output();
+    float level = pulse_table[pulse[0].output() + pulse[1].output()] +
+                  tnd_table[3 * tri + 2 * noise.output() + dmc.level];
+    if (level != mix_level) {
+        blip.add_delta((uint32_t)(time - frame_start), level - mix_level);
+        mix_level = level;
+    }
+}
+
+// Earliest cycle an IRQ could be raised if nothing is written in between.
+// The DMC estimate can be early (the buffer may already be empty), which
+// only means irq() catches up once more than it had to.
+void APU::predict_irq() {
+    next_irq = UINT64_MAX;
+
+    if (!five_step && !irq_inhibit) {
+        next_irq = time + frame_counter + (FOUR_STEP[3] - FOUR_STEP[frame_step]);
+    }
+
+    if (dmc.irq_enabled && !dmc.loop && dmc.bytes_remaining > 0) {
+        uint64_t rate = dmc.step_cycles();
+        uint64_t at = time + dmc.counter + ((dmc.bits_remaining - 1) + 8 * (uint64_t)(dmc.bytes_remaining - 1)) * rate;
+        if (at < next_irq) {
+            next_irq = at;
+        }
+    }
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "audio_filter.h"
+#include "audio_ring.h"
+#include "blip.h"
+
+/*
+ * 2A03 APU: two pulse channels, triangle, noise, DMC and the frame counter.
+ *
+ * Nothing here runs per CPU cycle. Register writes are queued with the CPU
+ * cycle they happened on and the channels are synthesized in one batch at
+ * the end of the frame: between writes and frame counter steps the channel
+ * state only changes when a channel timer expires, so the batch jumps from
+ * one timer expiry to the next and hands each change of the mixed output to
+ * a BlipBuffer as a band-limited step.
+ *
+ * The CPU can observe the APU through $4015 reads and the IRQ line. A $4015
+ * read catches the synthesis up to the read's cycle first. For the IRQ line
+ * the APU predicts the earliest cycle either IRQ source could fire and only
+ * catches up once the CPU gets there.
+ */
+
+class CPU;
+class StateWriter;
+class StateReader;
+
+struct Envelope {
+    bool start;
+    bool loop;      // also the length counter halt flag
+    bool constant;
+    uint8_t volume; // constant volume or divider period
+    uint8_t divider;
+    uint8_t decay;
+
+    void clock();
+    uint8_t output() const { return constant ? volume : decay; }
+};
+
+struct Pulse {
+    Envelope envelope;
+    uint8_t duty;
+    bool enabled;      // $4015 bit, the length counter only loads while set
+    uint8_t sequence;  // position in the 8 step duty cycle
+    uint16_t period;   // 11 bit timer reload
+    uint32_t counter;  // CPU cycles until the sequencer steps
+    uint8_t length;
+    bool sweep_enabled;
+    bool sweep_negate;
+    bool sweep_reload;
+    uint8_t sweep_period;
+    uint8_t sweep_shift;
+    uint8_t sweep_divider;
+    bool ones_complement; // pulse 1 negates with one's complement
+
+    uint16_t sweep_target() const;
+    bool muted() const { return period < 8 || sweep_target() > 0x7FF; }
+    bool audible() const { return length > 0 && !muted(); }
+    uint32_t step_cycles() const { return (period + 1u) * 2; }
+    void clock_sweep();
+    void skip(uint32_t cycles);
+    uint8_t output() const;
+};
+
+struct Triangle {
+    bool enabled;
+    uint8_t sequence;  // 0-31
+    uint16_t period;
+    uint32_t counter;
+    uint8_t length;
+    bool control;      // length counter halt and linear counter control
+    uint8_t linear_reload_value;
+    uint8_t linear;
+    bool linear_reload;
+
+    // the sequencer is frozen when either counter is zero, and at ultrasonic
+    // periods where the real chip just produces a flat average
+    bool stepping() const { return length > 0 && linear > 0 && period >= 2; }
+    uint32_t step_cycles() const { return period + 1u; }
+    void clock_linear();
+    uint8_t output() const;
+};
+
+struct Noise {
+    Envelope envelope;
+    bool enabled;
+    bool mode;
+    uint8_t period_index;
+    uint16_t shift;
+    uint32_t counter;
+    uint8_t length;
+
+    bool audible() const { return length > 0; }
+    uint32_t step_cycles() const;
+    void step();
+    void skip(uint32_t cycles);
+    uint8_t output() const;
+};
+
+struct DMC {
+    bool irq_enabled;
+    bool loop;
+    uint8_t rate_index;
+    uint32_t counter;
+    uint8_t level;        // 7 bit output
+    uint16_t sample_address;
+    uint16_t sample_length;
+    uint16_t current_address;
+    uint16_t bytes_remaining;
+    uint8_t shift;
+    uint8_t bits_remaining;
+    bool silence;
+    uint8_t buffer;
+    bool buffer_full;
+
+    uint32_t step_cycles() const;
+    void restart();
+};
+
+class APU {
+public:
+    APU();
+    void connectCPU(CPU*); // the DMC reads samples through the CPU bus
+    void set_sample_rate(int rate);
+    void set_rate_ratio(double ratio); // fine adjustment of the sample rate, see AudioRateControl
+    void set_quality(int taps);        // resampler FIR taps, see BlipBuffer::set_quality
+    void set_filter(AudioFilter mode);
+    // Keep emulating but leave muted frames out of the output entirely, so a
+    // state loaded afterwards (rewind, run-ahead) carries on seamlessly from
+    // the last frame that was heard
+    void set_muted(bool mute);
+    void reset();
+
+    // $4000-$4013, $4015 and $4017, at the CPU cycle the write happened on
+    void write_register(uint16_t addr, uint8_t value, uint64_t cycle);
+    uint8_t read_status(uint64_t cycle); // $4015
+
+    // IRQ line level at a CPU cycle, checked before every instruction so
+    // the common case (nothing due yet) stays inline
+    bool irq(uint64_t cycle) {
+        if (!frame_irq && !dmc_irq && cycle < next_irq) {
+            return false;
+        }
+        return irq_catch_up(cycle);
+    }
+
+    // Synthesize up to cycle (the end of the frame) and queue the samples
+    void end_frame(uint64_t cycle);
+
+    AudioRing& output(); // samples for the audio callback
+
+    // Channel, frame counter and queued write state. The resampler and
+    // filters aren't part of it, audio carries on from a load with a step.
+    void save_state(StateWriter& w) const;
+    bool load_state(StateReader& r);
+    void copy_state_from(const APU& other); // same as a load, output settings stay
+
+private:
+    struct Write {
+        uint64_t cycle;
+        uint16_t addr;
+        uint8_t value;
+    };
+
+    bool irq_catch_up(uint64_t cycle);
+    void run_until(uint64_t cycle);
+    void synthesize(uint32_t cycles);
+    void apply_write(uint16_t addr, uint8_t value);
+    void clock_frame_counter();
+    void quarter_frame();
+    void half_frame();
+    void dmc_step();
+    void dmc_fetch();
+    void update_output();
+    void predict_irq();
+
+    CPU* cpu;
+    Pulse pulse[2];
+    Triangle triangle;
+    Noise noise;
+    DMC dmc;
+
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    bool dmc_irq;
+    int frame_step;          // next step of the frame counter sequence
+    uint32_t frame_counter;  // CPU cycles until that step
+
+    uint64_t time;           // CPU cycle the channels have been run up to
+    uint64_t frame_start;    // CPU cycle of the first sample of the current frame
+    uint64_t next_irq;       // earliest cycle an IRQ could assert without further writes
+    std::vector<Write> writes;
+
+    float mix_level;         // last mixer output handed to the buffer
+    bool muted;
+    float pulse_table[31];
+    float tnd_table[203];
+
+    BlipBuffer blip;
+    FilterChain filter;
+    AudioRing ring;
+    std::vector<float> mixed;     // a frame of resampled output before filtering
+    std::vector<int16_t> samples; // scratch for moving samples into the ring
+};
@@ -0,0 +1,144 @@
+#include "audio_filter.h"
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+#ifdef __SSE2__
+// move lanes up by n, zero filling: [a b c d] -> [0 a b c] for n = 1
+template <int n>
+static inline __m128 shift_up(__m128 v) {
+    return _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), n * 4));
+}
+#endif
+
+void first_order_scan(float* data, int count, float a, float& state) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 a1 = _mm_set1_ps(a);
+    const __m128 a2 = _mm_set1_ps(a * a);
+    const __m128 carry = _mm_setr_ps(a, a * a, a * a * a, a * a * a * a);
+    __m128 prev = _mm_set1_ps(state);
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(data + i);
+        v = _mm_add_ps(v, _mm_mul_ps(a1, shift_up<1>(v)));  // [u0, u1+a*u0, u2+a*u1, u3+a*u2]
+        v = _mm_add_ps(v, _mm_mul_ps(a2, shift_up<2>(v)));  // each lane now sums all of its block
+        v = _mm_add_ps(v, _mm_mul_ps(carry, prev));        // plus the previous block's last output
+        _mm_storeu_ps(data + i, v);
+        prev = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    state = _mm_cvtss_f32(prev);
+#endif
+    for (; i < count; i++) {
+        state = a * state + data[i];
+        data[i] = state;
+    }
+}
+
+void convert_to_int16(const float* in, int16_t* out, int count, float scale) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), s));
+        __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), s));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi)); // saturates
+    }
+#endif
+    for (; i < count; i++) {
+        float v = std::nearbyint(in[i] * scale);
+        if (v > 32767.0f) v = 32767.0f;
+        if (v < -32768.0f) v = -32768.0f;
+        out[i] = (int16_t)v;
+    }
+}
+
+FilterChain::FilterChain() : mode(FILTER_DC) {
+    set_rate(48000);
+}
+
+void FilterChain::set_rate(double sample_rate) {
+    set_high_pass(dc, 5.0, sample_rate);
+    set_high_pass(hp90, 90.0, sample_rate);
+    set_high_pass(hp440, 440.0, sample_rate);
+    set_low_pass(lp14k, 14000.0, sample_rate);
+    reset();
+}
+
+void FilterChain::set_mode(AudioFilter new_mode) {
+    mode = new_mode;
+    reset();
+}
+
+AudioFilter FilterChain::get_mode() const {
+    return mode;
+}
+
+void FilterChain::reset() {
+    dc.last_in = dc.state = 0;
+    hp90.last_in = hp90.state = 0;
+    hp440.last_in = hp440.state = 0;
+    lp14k.state = 0;
+}
+
+void FilterChain::process(float* samples, int count) {
+    if (mode == FILTER_NES) {
+        run(hp90, samples, count);
+        run(hp440, samples, count);
+        run(lp14k, samples, count);
+    }
+    else {
+        run(dc, samples, count);
+    }
+}
+
+void FilterChain::set_high_pass(HighPass& f, double cutoff, double sample_rate) {
+    double rc = 1.0 / (2 * PI * cutoff);
+    double dt = 1.0 / sample_rate;
+    f.a = (float)(rc / (rc + dt));
+}
+
+void FilterChain::set_low_pass(LowPass& f, double cutoff, double sample_rate) {
+    double rc = 1.0 / (2 * PI * cutoff);
+    double dt = 1.0 / sample_rate;
+    f.k = (float)(dt / (rc + dt));
+}
+
+// u[n] = a * (x[n] - x[n-1]), then the scan adds a * y[n-1]
+void FilterChain::run(HighPass& f, float* samples, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 a = _mm_set1_ps(f.a);
+    __m128 last = _mm_set_ss(f.last_in);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(samples + i);
+        __m128 x_prev = _mm_move_ss(shift_up<1>(x), last); // [x-1, x0, x1, x2]
+        last = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+        _mm_storeu_ps(samples + i, _mm_mul_ps(a, _mm_sub_ps(x, x_prev)));
+    }
+    f.last_in = _mm_cvtss_f32(last);
+#endif
+    for (; i < count; i++) {
+        float x = samples[i];
+        samples[i] = f.a * (x - f.last_in);
+        f.last_in = x;
+    }
+    first_order_scan(samples, count, f.a, f.state);
+}
+
+// u[n] = k * x[n], then the scan adds (1 - k) * y[n-1]
+void FilterChain::run(LowPass& f, float* samples, int count) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 k = _mm_set1_ps(f.k);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(samples + i, _mm_mul_ps(k, _mm_loadu_ps(samples + i)));
+    }
+#endif
+    for (; i < count; i++) {
+        samples[i] *= f.k;
+    }
+    first_order_scan(samples, count, 1.0f - f.k, f.state);
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+
+/*
+ * Output filtering for the APU, applied to a whole frame of samples at once.
+ *
+ * Every stage here is a first-order recurrence y[n] = a * y[n-1] + u[n]. That
+ * looks inherently serial, but four outputs at a time can be computed from
+ * four inputs with two shift-multiply-adds (a parallel prefix scan) plus the
+ * carried-in state scaled by a, a^2, a^3, a^4, so the SSE path handles a
+ * frame in blocks of four instead of one sample at a time.
+ */
+
+// In place: data[i] = a * data[i-1] + data[i], with state holding the
+// previous output before the call and the last output after it
+void first_order_scan(float* data, int count, float a, float& state);
+
+// Scale to 16-bit and saturate
+void convert_to_int16(const float* in, int16_t* out, int count, float scale);
+
+enum AudioFilter {
+    FILTER_DC,  // only remove the DC offset of the mixer output
+    FILTER_NES  // the console's output stage: high-pass 90 Hz and 440 Hz, low-pass 14 kHz
+};
+
+class FilterChain {
+public:
+    FilterChain();
+    void set_rate(double sample_rate);
+    void set_mode(AudioFilter mode);
+    AudioFilter get_mode() const;
+    void reset();
+
+    void process(float* samples, int count); // in place
+
+private:
+    // RC high-pass: y[n] = a * (y[n-1] + x[n] - x[n-1])
+    struct HighPass {
+        float a;
+        float last_in;
+        float state;
+    };
+    // RC low-pass: y[n] = y[n-1] + k * (x[n] - y[n-1])
+    struct LowPass {
+        float k;
+        float state;
+    };
+
+    static void set_high_pass(HighPass& f, double cutoff, double sample_rate);
+    static void set_low_pass(LowPass& f, double cutoff, double sample_rate);
+    static void run(HighPass& f, float* samples, int count);
+    static void run(LowPass& f, float* samples, int count);
+
+    AudioFilter mode;
+    HighPass dc;
+    HighPass hp90;
+    HighPass hp440;
+    LowPass lp14k;
+};
@@ -0,0 +1,61 @@
+#include "audio_ring.h"
+
+AudioRing::AudioRing(size_t capacity) : head(0), tail(0), underrun_count(0), dropped_count(0) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    data.assign(size, 0);
+    mask = size - 1;
+    limit = size;
+}
+
+size_t AudioRing::write(const int16_t* samples, size_t count) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t space = (h - t < limit) ? limit - (h - t) : 0;
+    if (count > space) {
+        dropped_count.fetch_add(count - space, std::memory_order_relaxed);
+        count = space;
+    }
+    for (size_t i = 0; i < count; i++) {
+        data[(h + i) & mask] = samples[i];
+    }
+    head.store(h + count, std::memory_order_release);
+    return count;
+}
+
+size_t AudioRing::read(int16_t* out, size_t count) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t avail = h - t;
+    if (count > avail) {
+        underrun_count.fetch_add(1, std::memory_order_relaxed);
+        count = avail;
+    }
+    for (size_t i = 0; i < count; i++) {
+        out[i] = data[(t + i) & mask];
+    }
+    tail.store(t + count, std::memory_order_release);
+    return count;
+}
+
+size_t AudioRing::size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+size_t AudioRing::capacity() const {
+    return data.size();
+}
+
+void AudioRing::set_limit(size_t samples) {
+    limit = (samples < data.size()) ? samples : data.size();
+}
+
+uint64_t AudioRing::underruns() const {
+    return underrun_count.load(std::memory_order_relaxed);
+}
+
+uint64_t AudioRing::dropped() const {
+    return dropped_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lock-free single producer/single consumer queue of samples between the
+// emulation thread and the SDL audio callback
+class AudioRing {
+public:
+    explicit AudioRing(size_t capacity); // rounded up to a power of two
+
+    // producer side, returns how many samples fit
+    size_t write(const int16_t* samples, size_t count);
+
+    // consumer side, returns how many samples were available
+    size_t read(int16_t* out, size_t count);
+
+    size_t size() const; // samples buffered right now
+    size_t capacity() const;
+
+    // cap on buffered samples below capacity, writes past it are dropped (producer side)
+    void set_limit(size_t samples);
+
+    uint64_t underruns() const; // reads that came up short
+    uint64_t dropped() const;   // samples that didn't fit
+
+private:
+    std::vector<int16_t> data;
+    size_t mask;
+    std::atomic<size_t> head; // total written, only the producer stores it
+    std::atomic<size_t> tail; // total read, only the consumer stores it
+    size_t limit;
+    std::atomic<uint64_t> underrun_count;
+    std::atomic<uint64_t> dropped_count;
+};
@@ -0,0 +1,124 @@
+#include "batch_env.h"
+#include <cstring>
+
+std::unique_ptr<BatchEnv> BatchEnv::create(std::shared_ptr<const RomImage> rom, size_t count, unsigned threads,
+                                           int frame_scale) {
+    // checked once here, the workers load the same image and can't fail
+    std::unique_ptr<Console> power_on(new Console());
+    if (!rom || !power_on->load_rom(rom)) {
+        return nullptr;
+    }
+    return std::unique_ptr<BatchEnv>(new BatchEnv(std::move(power_on), count, threads, frame_scale));
+}
+
+BatchEnv::BatchEnv(std::unique_ptr<Console> power_on_console, size_t count, unsigned threads, int scale)
+    : rom(power_on_console->get_cpu().mapper->rom_image()), frame_scale(scale > 0 ? scale : 0),
+      power_on(std::move(power_on_console)), consoles(count), out_ram(nullptr), out_frames(nullptr),
+      out_frame_counts(nullptr), actions(nullptr), active(0), generation(0), pending(0), stopping(false) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > count && count > 0) {
+        threads = (unsigned)count;
+    }
+
+    // the workers create their own consoles, wait until all of them exist
+    std::unique_lock<std::mutex> guard(lock);
+    worker_count = threads;
+    pending = threads;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&BatchEnv::worker, this, i);
+    }
+    work_done.wait(guard, [this] { return pending == 0; });
+}
+
+BatchEnv::~BatchEnv() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void BatchEnv::set_outputs(uint8_t* ram, uint8_t* frames, uint64_t* frame_counts) {
+    out_ram = ram;
+    out_frames = frame_scale > 0 ? frames : nullptr;
+    out_frame_counts = frame_counts;
+}
+
+void BatchEnv::step(const uint8_t* step_actions, size_t n) {
+    std::unique_lock<std::mutex> guard(lock);
+    actions = step_actions;
+    active = n < consoles.size() ? n : consoles.size();
+    pending = (unsigned)workers.size();
+    generation++;
+    work_ready.notify_all();
+    work_done.wait(guard, [this] { return pending == 0; });
+}
+
+void BatchEnv::reset(size_t index) {
+    consoles[index]->copy_state_from(*power_on);
+}
+
+void BatchEnv::worker(unsigned index) {
+    // a fixed slice of the consoles, created here so their memory is local
+    // to this thread
+    size_t first = consoles.size() * index / worker_count;
+    size_t last = consoles.size() * (index + 1) / worker_count;
+    for (size_t i = first; i < last; i++) {
+        Console* c = new Console();
+        c->load_rom(rom);
+        if (frame_scale > 0) {
+            c->get_ppu().enableGrayOutput(frame_scale);
+        }
+        c->get_ppu().setRenderMode(frame_scale > 0 ? RENDER_GRAY : RENDER_OFF);
+        c->get_apu().set_muted(true);
+        consoles[i].reset(c);
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t seen = generation;
+    if (--pending == 0) {
+        work_done.notify_one();
+    }
+    while (true) {
+        work_ready.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        size_t end = last < active ? last : active;
+
+        guard.unlock();
+        for (size_t i = first; i < end; i++) {
+            step_one(i);
+        }
+        guard.lock();
+
+        if (--pending == 0) {
+            work_done.notify_one();
+        }
+    }
+}
+
+void BatchEnv::step_one(size_t index) {
+    Console& c = *consoles[index];
+    c.set_buttons(actions[index], 0);
+    c.run_frame();
+
+    if (out_ram) {
+        memcpy(out_ram + index * RAM_BYTES, c.get_cpu().get_ram(), RAM_BYTES);
+    }
+    if (out_frames) {
+        memcpy(out_frames + index * frame_bytes(), c.get_ppu().grayFrame(), frame_bytes());
+    }
+    if (out_frame_counts) {
+        out_frame_counts[index] = c.get_ppu().getFrame();
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "console.h"
+#include "rom.h"
+
+/*
+ * Many consoles on one game stepped in lockstep, for training agents.
+ *
+ * Every console belongs to one worker thread for its whole life: the
+ * worker creates it, and every step runs it on that same thread, so its
+ * state stays in that core's caches. step() hands each worker its slice
+ * and returns once all of them are done. Audio is off; the picture is only
+ * drawn when frame observations are asked for, and then straight to
+ * grayscale by the PPU (RENDER_GRAY).
+ *
+ * Observations go to buffers the caller owns, laid out by console index:
+ *   ram           n * RAM_BYTES, the CPU's 2KB of RAM after the frame
+ *   frames        n * frame_bytes(), grayscale downsampled by frame_scale
+ *                 (frame_width() x frame_height(), row major), each pixel
+ *                 the max of this frame and the last, or nullptr
+ *   frame_counts  n, frames each console has run since power on
+ */
+class BatchEnv {
+public:
+    static constexpr size_t RAM_BYTES = 0x800;
+
+    // count consoles running rom on threads workers (0 = one per core).
+    // frame_scale > 0 turns on frame observations at 1/frame_scale size
+    // in each direction. nullptr if rom is nullptr or its mapper isn't
+    // supported (said on stderr).
+    static std::unique_ptr<BatchEnv> create(std::shared_ptr<const RomImage> rom, size_t count,
+                                            unsigned threads = 0, int frame_scale = 0);
+    ~BatchEnv(); // stops and joins the workers
+    BatchEnv(const BatchEnv&) = delete;
+    BatchEnv& operator=(const BatchEnv&) = delete;
+
+    size_t size() const { return consoles.size(); }
+    unsigned thread_count() const { return (unsigned)workers.size(); }
+    int frame_width() const { return frame_scale > 0 ? 256 / frame_scale : 0; }
+    int frame_height() const { return frame_scale > 0 ? 240 / frame_scale : 0; }
+    size_t frame_bytes() const { return (size_t)frame_width() * frame_height(); }
+
+    // Where step() writes. Any of them can be nullptr; frames also needs
+    // frame_scale > 0.
+    void set_outputs(uint8_t* ram, uint8_t* frames, uint64_t* frame_counts);
+
+    // Run consoles 0..n-1 one frame each with actions[i] as console i's
+    // controller 1 buttons (BUTTON_*), then write their observations
+    void step(const uint8_t* actions, size_t n);
+
+    // Back to the power on state, between steps
+    void reset(size_t index);
+
+    // For setting up a console (load a state, change settings) between steps
+    Console& console(size_t index) { return *consoles[index]; }
+
+private:
+    // power_on has the ROM loaded already
+    BatchEnv(std::unique_ptr<Console> power_on, size_t count, unsigned threads, int frame_scale);
+    void worker(unsigned index);
+    void step_one(size_t index);
+
+    std::shared_ptr<const RomImage> rom;
+    int frame_scale;
+    std::unique_ptr<Console> power_on; // what reset() copies from
+    std::vector<std::unique_ptr<Console>> consoles;
+
+    // outputs and the current step's work
+    uint8_t* out_ram;
+    uint8_t* out_frames;
+    uint64_t* out_frame_counts;
+    const uint8_t* actions;
+    size_t active;
+
+    // workers wait for generation to change, step() waits for pending to
+    // reach zero
+    std::vector<std::thread> workers;
+    unsigned worker_count;
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    uint64_t generation;
+    unsigned pending;
+    bool stopping;
+};
@@ -0,0 +1,98 @@
+#include "bgcache.h"
+#include "mapper.h"
+
+BackgroundCache::BackgroundCache() {
+    memset(pixels, 0, sizeof(pixels));
+    pattern_base = 0;
+    version = 0;
+    invalidate_all();
+}
+
+void BackgroundCache::invalidate_all() {
+    for (int nt = 0; nt < 4; nt++) {
+        for (int row = 0; row < 30; row++) {
+            dirty[nt][row] = 0xFFFFFFFFu;
+        }
+    }
+}
+
+void BackgroundCache::nametable_written(uint16_t addr) {
+    uint16_t offset = addr & 0x3FF;
+
+    if (offset < 0x3C0) {
+        // tile index byte, one tile
+        int row = offset / 32;
+        int col = offset % 32;
+        for (int nt = 0; nt < 4; nt++) {
+            dirty[nt][row] |= (1u << col);
+        }
+    }
+    else {
+        // attribute byte, a 4x4 block of tiles (the last block row is only 2 tall)
+        int attr_row = (offset - 0x3C0) / 8;
+        int attr_col = (offset - 0x3C0) % 8;
+        uint32_t cols = 0xFu << (attr_col * 4);
+        for (int row = attr_row * 4; row < attr_row * 4 + 4 && row < 30; row++) {
+            for (int nt = 0; nt < 4; nt++) {
+                dirty[nt][row] |= cols;
+            }
+        }
+    }
+}
+
+void BackgroundCache::sync(uint16_t bg_pattern_base, uint32_t map_version) {
+    if (bg_pattern_base != pattern_base || map_version != version) {
+        pattern_base = bg_pattern_base;
+        version = map_version;
+        invalidate_all();
+    }
+}
+
+void BackgroundCache::refresh_tile(Mapper* mapper, int nt, int row, int col) {
+    uint16_t base_nametable = 0x2000 + nt * 0x400;
+    uint8_t tile_number = mapper->read_ppu(base_nametable + row * 32 + col);
+    uint8_t attr_byte = mapper->read_ppu(base_nametable + 0x3C0 + (row / 4) * 8 + (col / 4));
+
+    // same quadrant select as PPU::background_pixel
+    int shift = (((row % 4) / 2) * 2 + ((col % 4) / 2)) * 2;
+    uint8_t palette_high_bits = (attr_byte >> shift) & 0x03;
+
+    int top = (nt >> 1) * 240 + row * 8;
+    int left = (nt & 1) * 256 + col * 8;
+    uint16_t tile_addr = pattern_base + (uint16_t)tile_number * 16;
+
+    for (int fineY = 0; fineY < 8; fineY++) {
+        uint8_t low = mapper->read_ppu((tile_addr + fineY) & 0x1FFF);
+        uint8_t high = mapper->read_ppu((tile_addr + fineY + 8) & 0x1FFF);
+        uint8_t* out = &pixels[top + fineY][left];
+        for (int px = 0; px < 8; px++) {
+            uint8_t bit0 = (low >> (7 - px)) & 1;
+            uint8_t bit1 = (high >> (7 - px)) & 1;
+            out[px] = (palette_high_bits << 2) | (bit1 << 1) | bit0;
+        }
+    }
+}
+
+void BackgroundCache::read_line(Mapper* mapper, int x, int y, uint8_t* out) {
+    // bring the tile row under this line up to date in both horizontal nametables
+    int nt_top = (y / 240) * 2;
+    int row = (y % 240) / 8;
+    for (int nt = nt_top; nt < nt_top + 2; nt++) {
+        uint32_t bits = dirty[nt][row];
+        if (!bits) {
+            continue;
+        }
+        for (int col = 0; col < 32; col++) {
+            if (bits & (1u << col)) {
+                refresh_tile(mapper, nt, row, col);
+            }
+        }
+        dirty[nt][row] = 0;
+    }
+
+    // scrolled copy, wrapping around the right edge of the 512 wide map
+    x &= 511;
+    int first = (512 - x < 256) ? (512 - x) : 256;
+    memcpy(out, &pixels[y][x], first);
+    memcpy(out + first, &pixels[y][0], 256 - first);
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+class Mapper;
+
+/*
+ * Pre-rendered background for the four logical nametables, laid out as one
+ * 512x480 indexed bitmap:
+ *
+ *   NT0 ($2000) | NT1 ($2400)
+ *   ------------+------------
+ *   NT2 ($2800) | NT3 ($2C00)
+ *
+ * Each byte is (attribute palette << 2) | 2-bit pattern color, so palette
+ * writes never invalidate anything. Tiles are redrawn lazily: writes mark
+ * them dirty and read_line() refreshes the dirty tiles of the tile row it
+ * needs before copying.
+ *
+ * The cache doesn't know the mapper's mirroring, so a nametable write marks
+ * the same tile in all four logical nametables.
+ */
+class BackgroundCache {
+public:
+    BackgroundCache();
+
+    // redraw everything on next use (CHR data changed, etc.)
+    void invalidate_all();
+
+    // a byte in $2000-$3EFF was written, mark the tile(s) it affects
+    void nametable_written(uint16_t addr);
+
+    // Pattern table base ($0000/$1000) and mapper PPU mapping version in use.
+    // A change to either invalidates the whole cache.
+    void sync(uint16_t bg_pattern_base, uint32_t map_version);
+
+    // Copy the 256 pixels starting at (x, y) of the 512x480 bitmap into out,
+    // wrapping horizontally.
+    void read_line(Mapper* mapper, int x, int y, uint8_t* out);
+
+private:
+    void refresh_tile(Mapper* mapper, int nt, int row, int col);
+
+    uint8_t pixels[480][512];
+    uint32_t dirty[4][30]; // per nametable and tile row, bit n = tile column n
+    uint16_t pattern_base;
+    uint32_t version;
+};
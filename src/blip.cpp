@@ -0,0 +1,125 @@
+#include "blip.h"
+#include "audio_filter.h"
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const double PI = 3.14159265358979323846;
+
+BlipBuffer::BlipBuffer() : base_factor(0), factor(0), offset(0), integrator(0) {
+    set_quality(16);
+}
+
+void BlipBuffer::set_rates(double clock_rate, double sample_rate) {
+    base_factor = sample_rate / clock_rate;
+    set_rate_scale(1.0);
+
+    // room for 100 ms of output per frame plus the kernel tail
+    buffer.assign((size_t)(sample_rate / 10) + MAX_WIDTH * 2, 0.0f);
+    clear();
+}
+
+void BlipBuffer::set_rate_scale(double scale) {
+    factor = (uint64_t)(base_factor * scale * ((uint64_t)1 << FRAC_BITS) + 0.5);
+}
+
+void BlipBuffer::set_quality(int taps) {
+    width = (taps + 7) / 8 * 8;
+    if (width < 8) width = 8;
+    if (width > MAX_WIDTH) width = MAX_WIDTH;
+    int half = width / 2;
+
+    // Windowed sinc per phase. Cutoff a bit under Nyquist so the step's
+    // ringing stays out of the audible top octave, each phase normalized to
+    // unit sum so a step of delta always settles at exactly delta.
+    const double cutoff = 0.45;
+    kernel.assign(PHASES * width, 0.0f);
+    for (int p = 0; p < PHASES; p++) {
+        float* row = &kernel[p * width];
+        double frac = (double)p / PHASES;
+        double sum = 0;
+        for (int k = 0; k < width; k++) {
+            double x = k - (half - 1) - frac;
+            double sinc = (x == 0) ? 1.0 : std::sin(2 * PI * cutoff * x) / (2 * PI * cutoff * x);
+            double w = (x + half) / width; // blackman window over [-half, half]
+            double window = 0.42 - 0.5 * std::cos(2 * PI * w) + 0.08 * std::cos(4 * PI * w);
+            row[k] = (float)(sinc * window);
+            sum += row[k];
+        }
+        for (int k = 0; k < width; k++) {
+            row[k] = (float)(row[k] / sum);
+        }
+    }
+    clear();
+}
+
+int BlipBuffer::get_quality() const {
+    return width;
+}
+
+void BlipBuffer::add_delta(uint32_t clock_time, float delta) {
+    uint64_t pos = offset + clock_time * factor;
+    size_t index = (size_t)(pos >> FRAC_BITS);
+    int phase = (int)(pos >> (FRAC_BITS - PHASE_BITS)) & (PHASES - 1);
+    if (index + width > buffer.size()) {
+        return; // frame too long for the buffer, drop rather than overrun
+    }
+
+    float* out = &buffer[index];
+    const float* k = &kernel[phase * width];
+#ifdef __SSE2__
+    // width is a multiple of 8
+    const __m128 d = _mm_set1_ps(delta);
+    for (int i = 0; i < width; i += 8) {
+        __m128 o0 = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(d, _mm_loadu_ps(k + i)));
+        __m128 o1 = _mm_add_ps(_mm_loadu_ps(out + i + 4), _mm_mul_ps(d, _mm_loadu_ps(k + i + 4)));
+        _mm_storeu_ps(out + i, o0);
+        _mm_storeu_ps(out + i + 4, o1);
+    }
+#else
+    for (int i = 0; i < width; i++) {
+        out[i] += delta * k[i];
+    }
+#endif
+}
+
+void BlipBuffer::end_frame(uint32_t clock_duration) {
+    offset += clock_duration * factor;
+
+    // a frame longer than the buffer lost its tail in add_delta already,
+    // don't let the read run past the end as well
+    uint64_t limit = (uint64_t)(buffer.size() - MAX_WIDTH) << FRAC_BITS;
+    if (offset > limit) {
+        offset = limit;
+    }
+}
+
+int BlipBuffer::samples_avail() const {
+    return (int)(offset >> FRAC_BITS);
+}
+
+int BlipBuffer::read_samples(float* out, int max) {
+    int count = samples_avail();
+    if (count > max) {
+        count = max;
+    }
+
+    // integrate the impulses, the scan with a = 1 is a running sum
+    std::memcpy(out, buffer.data(), count * sizeof(float));
+    first_order_scan(out, count, 1.0f, integrator);
+
+    // slide the unread part (and the kernel tails past it) to the front
+    size_t remain = buffer.size() - count;
+    std::memmove(buffer.data(), buffer.data() + count, remain * sizeof(float));
+    std::memset(buffer.data() + remain, 0, count * sizeof(float));
+    offset -= (uint64_t)count << FRAC_BITS;
+    return count;
+}
+
+void BlipBuffer::clear() {
+    std::fill(buffer.begin(), buffer.end(), 0.0f);
+    offset = 0;
+    integrator = 0;
+}
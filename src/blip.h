@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+/*
+ * Band-limited step synthesis (in the style of blargg's blip_buf).
+ *
+ * The APU's output is a sum of square-ish waves that only change at
+ * discrete clock times. Instead of generating every clock and filtering, we
+ * add each amplitude change as a band-limited step: a windowed-sinc impulse
+ * picked from a table by the change's sub-sample phase, accumulated into a
+ * buffer at the output rate. This is a polyphase FIR resampler from the CPU
+ * clock to the host rate that only does work where the input changes.
+ * Reading integrates the impulses back into a waveform.
+ */
+class BlipBuffer {
+public:
+    BlipBuffer();
+
+    // clock rate of add_delta times (CPU clock) and output sample rate
+    void set_rates(double clock_rate, double sample_rate);
+
+    // Scale the output rate by a small factor without losing buffered
+    // samples, for dynamic rate control. Applies from the next frame.
+    void set_rate_scale(double scale);
+
+    // FIR taps per phase, 8 to 32 in steps of 8 (default 16). More taps
+    // give a steeper cutoff and less aliasing for more work per change.
+    // Clears the buffer.
+    void set_quality(int taps);
+    int get_quality() const;
+
+    // Amplitude change at clock_time clocks after the start of the frame
+    void add_delta(uint32_t clock_time, float delta);
+
+    // end the frame at clock_duration, samples before it become readable
+    void end_frame(uint32_t clock_duration);
+
+    int samples_avail() const;
+
+    // read and remove up to max samples of the waveform, in mixer units
+    int read_samples(float* out, int max);
+
+    void clear();
+
+private:
+    static constexpr int PHASE_BITS = 5;
+    static constexpr int PHASES = 1 << PHASE_BITS;
+    static constexpr int MAX_WIDTH = 32;
+    static constexpr int FRAC_BITS = 32;
+
+    int width;                 // taps per phase
+    std::vector<float> kernel; // PHASES rows of width taps
+    std::vector<float> buffer; // impulses, integrated on read
+    double base_factor;        // sample_rate / clock_rate
+    uint64_t factor;           // output samples per clock, 32.32 fixed point
+    uint64_t offset;           // start of the current frame in output samples, 32.32
+    float integrator;
+};
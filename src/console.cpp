@@ -0,0 +1,129 @@
+#include "console.h"
+#include "savestate.h"
+#include "trace.h"
+
+Console::Console() {
+    // connect all units to each other, the mapper follows in load_rom
+    ppu.connectCPU(&cpu);
+    ppu.connectInput(&input);
+    cpu.connectPPU(&ppu);
+    cpu.connectInput(&input);
+    cpu.connectAPU(&apu);
+    apu.connectCPU(&cpu);
+}
+
+bool Console::load_rom(const std::string& path) {
+    return load_rom(RomImage::load(path));
+}
+
+bool Console::load_rom(std::shared_ptr<const RomImage> rom) {
+    if (!cpu.loadROM(rom)) {
+        return false;
+    }
+    ppu.connectMapper(cpu.mapper);
+    return true;
+}
+
+void Console::run_frame() {
+    NoTrace none;
+    run_frame(none);
+}
+
+template <typename Trace>
+void Console::run_frame(Trace& trace) {
+    while (!step(trace)) {
+    }
+}
+
+// Between instructions the NMI edge detector always matches the PPU's NMI
+// line, so it starts from there and nothing carries over, which keeps
+// loading a state between frames (or stepping two consoles in lockstep)
+// safe.
+template <typename Trace>
+bool Console::step(Trace& trace) {
+    bool prevNMI = ppu.getNMI();
+    uint64_t frame = ppu.getFrame();
+
+    uint64_t before = cpu.get_cycles();
+    if (apu.irq(before) && !(cpu.get_P() & FLAG_INTERRUPT)) {
+        cpu.irq();
+    }
+    else {
+        cpu.step(trace);
+    }
+
+    uint64_t after = cpu.get_cycles();
+    uint64_t used = (after - before);
+    if (used == 0) {
+        used = 1;
+    }
+
+    // For every CPU cycle, tick the PPU 3 times. NMI only rises at 241/1
+    // and stays up until 261/1, so checking the edge once per instruction
+    // sees the same edges as checking every dot.
+    ppu.run(used * 3);
+    if (ppu.getNMI() && !prevNMI) {
+        cpu.nmi();
+        ppu.run(21); // 7 cycles * 3 dots
+    }
+
+    if (ppu.getFrame() == frame) {
+        return false;
+    }
+    // synthesize the frame's audio in one go
+    apu.end_frame(cpu.get_cycles());
+    return true;
+}
+
+template void Console::run_frame<NoTrace>(NoTrace&);
+template void Console::run_frame<NestestTracer>(NestestTracer&);
+template bool Console::step<NoTrace>(NoTrace&);
+template bool Console::step<NestestTracer>(NestestTracer&);
+
+void Console::save_state(std::vector<uint8_t>& out) const {
+    ::save_state(out, cpu, ppu, apu, input);
+}
+
+bool Console::load_state(const uint8_t* data, size_t size) {
+    return ::load_state(data, size, cpu, ppu, apu, input);
+}
+
+bool Console::copy_state_from(const Console& other) {
+    if (!loaded() || !other.loaded() || !cpu.mapper->rom_image()->same_game(*other.cpu.mapper->rom_image())) {
+        return false;
+    }
+    ppu.finishRender(); // render workers may still read the nametables
+    if (!cpu.mapper->copy_state_from(*other.cpu.mapper)) {
+        return false;
+    }
+    cpu.copy_state_from(other.cpu);
+    ppu.copy_state_from(other.ppu);
+    apu.copy_state_from(other.apu);
+    input = other.input;
+    return true;
+}
+
+std::unique_ptr<Console> Console::clone() const {
+    if (!loaded()) {
+        return nullptr;
+    }
+    std::unique_ptr<Console> child(new Console());
+    if (!child->load_rom(cpu.mapper->rom_image()) || !child->copy_state_from(*this)) {
+        return nullptr;
+    }
+    return child;
+}
+
+const uint32_t* Console::framebuffer() {
+    ppu.finishRender();
+    return ppu.framebuffer;
+}
+
+uint64_t Console::frame_hash() {
+    const uint8_t* pixels = (const uint8_t*)framebuffer();
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < 256 * 240 * sizeof(uint32_t); i++) {
+        hash = (hash ^ pixels[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
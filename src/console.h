@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "apu.h"
+#include "cpu.h"
+#include "input.h"
+#include "ppu.h"
+
+/*
+ * One whole NES: CPU, PPU, APU, controllers and the cartridge, wired to each
+ * other and owned by the console, so destroying it frees everything. A
+ * machine keeps all of its state inside its Console (nothing global or
+ * static that changes), so any number of consoles can exist in a process
+ * and each can be run on its own thread. A single console isn't thread safe,
+ * only one thread may use it at a time.
+ *
+ * The 240 KB framebuffer makes it large, keep it on the heap.
+ */
+class Console {
+public:
+    Console();
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    // Insert the cartridge at path and power on. false (with a message on
+    // stderr) if it can't be read or its mapper isn't supported; the console
+    // can't run until a load succeeds.
+    bool load_rom(const std::string& path);
+    // Same with an image from a RomCache, shared with every other console
+    // running the game
+    bool load_rom(std::shared_ptr<const RomImage> rom);
+    bool loaded() const { return cpu.mapper != nullptr; }
+
+    // Run until the PPU finishes the current frame (start of vblank) and
+    // synthesize the frame's audio
+    void run_frame();
+    // Same with a trace policy (trace.h: NoTrace, NestestTracer) shown every
+    // instruction
+    template <typename Trace>
+    void run_frame(Trace& trace);
+    // One instruction (or interrupt) and the PPU dots it took, the piece
+    // run_frame is made of. true when it finished the frame, whose audio
+    // is then synthesized too.
+    template <typename Trace>
+    bool step(Trace& trace);
+
+    // Button bits (BUTTON_*) for the following frames
+    void set_buttons(uint8_t player1, uint8_t player2) { input.set_buttons(player1, player2); }
+
+    void save_state(std::vector<uint8_t>& out) const;
+    bool load_state(const uint8_t* data, size_t size);
+
+    // Fork the machine for input search. copy_state_from makes this console
+    // continue exactly where other is, by copying registers and RAM field by
+    // field; the ROM stays shared and nothing is allocated, so reusing a pool
+    // of consoles this way takes well under a microsecond. Both have to run
+    // the same game (RomImage::same_game, false otherwise), a pointer
+    // compare for consoles sharing an image (clones, a RomCache) and a full
+    // compare of PRG and CHR for ones that don't. Settings (render mode,
+    // caches, audio) and the framebuffer aren't copied. clone() is a new
+    // console on the same ROM image with a copy of the state, nullptr if
+    // nothing is loaded.
+    bool copy_state_from(const Console& other);
+    std::unique_ptr<Console> clone() const;
+
+    // Finished picture of the last frame (waits for deferred rendering)
+    const uint32_t* framebuffer();
+    // FNV-1a of it, for telling whether two runs or two builds agree
+    uint64_t frame_hash();
+
+    CPU& get_cpu() { return cpu; }
+    PPU& get_ppu() { return ppu; }
+    APU& get_apu() { return apu; }
+    Input& get_input() { return input; }
+
+private:
+    // destroyed bottom up: the PPU's render workers stop before the CPU
+    // deletes the mapper they read from
+    CPU cpu;
+    PPU ppu;
+    APU apu;
+    Input input;
+};
@@ -1,6 +1,8 @@
 #include "cpu.h"
 #include "ppu.h"
 #include "input.h"
+#include "apu.h"
+#include "savestate.h"
 
 CPU::CPU() {
   A = 0x0;
@@ -8,14 +10,24 @@ CPU::CPU() {
   Y = 0x0;
   SP = 0xFD;
   P = 0x34;
+  PC = 0;
+  reset_vector = 0;
+  currentOpcode = 0;
 
   mapper = nullptr;
+  ppu = nullptr;
+  input = nullptr;
+  apu = nullptr;
 
-  memset(system_memory, 0, sizeof(system_memory));
-  memset(opcode_table, 0, sizeof(opcode_table));
+  memset(ram, 0, sizeof(ram));
   bad_instruction = false;
   cycles = 0;
 
+  init_opcode_table();
+}
+
+CPU::~CPU() {
+  delete mapper;
 }
 
 // Basic getters for debug purposes
@@ -23,6 +35,8 @@ uint8_t CPU::get_A() { return A; }
 
 uint16_t CPU::get_PC() { return PC; }
 
+void CPU::set_PC(uint16_t address) { PC = address; }
+
 uint8_t CPU::get_X() { return X; }
 
 uint8_t CPU::get_Y() { return Y; }
@@ -45,6 +59,56 @@ void CPU::connectInput(Input* input_ref) {
   input = input_ref;
 }
 
+void CPU::connectAPU(APU* apu_ref) {
+  apu = apu_ref;
+}
+
+// Registers and the 2KB of internal RAM, PRG-RAM is saved by the mapper
+void CPU::save_state(StateWriter& w) const {
+  w.begin_chunk(state_tag("CPU "), 1);
+  w.put(A);
+  w.put(X);
+  w.put(Y);
+  w.put(SP);
+  w.put(P);
+  w.put(PC);
+  w.put(cycles);
+  w.put(currentOpcode);
+  w.write(ram, sizeof(ram));
+  w.end_chunk();
+}
+
+bool CPU::load_state(StateReader& r) {
+  uint16_t version;
+  if (!r.open_chunk(state_tag("CPU "), version) || version != 1) {
+    return false;
+  }
+  r.get(A);
+  r.get(X);
+  r.get(Y);
+  r.get(SP);
+  r.get(P);
+  r.get(PC);
+  r.get(cycles);
+  r.get(currentOpcode);
+  r.read(ram, sizeof(ram));
+  return r.ok();
+}
+
+void CPU::copy_state_from(const CPU& other) {
+  A = other.A;
+  X = other.X;
+  Y = other.Y;
+  SP = other.SP;
+  P = other.P;
+  PC = other.PC;
+  reset_vector = other.reset_vector;
+  bad_instruction = other.bad_instruction;
+  cycles = other.cycles;
+  currentOpcode = other.currentOpcode;
+  memcpy(ram, other.ram, sizeof(ram));
+}
+
 /*
  * setting flag bits on or off based on
  * the flag macro constants
@@ -65,7 +129,7 @@ void CPU::set_flag(uint8_t flag, bool condition) {
 uint8_t CPU::read(uint16_t address) const {
 
   if (address < 0x2000) {
-    return system_memory[address & 0x07FF];
+    return ram[address & 0x07FF];
   }
 
   if (address == 0x2002) {
@@ -94,23 +158,31 @@ uint8_t CPU::read(uint16_t address) const {
     return 0x40;// default bus
   }
 
+  // APU status, catches the APU up to this cycle
+  if (address == 0x4015) {
+    if (apu) {
+      return apu->read_status(cycles);
+    }
+    return 0x00;
+  }
+
   if (address < 0x4020)  {
     return 0x00;
   }
 
-  // Cartridge/mapper space
-  if (address >= 0x8000 && mapper) {
+  // Cartridge/mapper space, PRG-RAM and PRG-ROM
+  if (mapper) {
       return mapper->read_cpu(address);
   }
 
-  return system_memory[address];
+  return 0x00;
 }
 
 
 void CPU::write(uint16_t address, uint8_t value) { 
 
   if (address < 0x2000) {
-     system_memory[address & 0x07FF] = value; return;
+     ram[address & 0x07FF] = value; return;
   }
 
   if (address >= 0x2000 && address < 0x4000) {
@@ -134,12 +206,17 @@ void CPU::write(uint16_t address, uint8_t value) {
     return;
   }
 
-  if (address >= 0x8000 && mapper) {
-    mapper->write_cpu(address, value);
+  // APU registers, $4017 writes go to the frame counter
+  if (address <= 0x4013 || address == 0x4015 || address == 0x4017) {
+    if (apu) {
+      apu->write_register(address, value, cycles);
+    }
     return;
   }
 
-  system_memory[address] = value; 
+  if (address >= 0x4020 && mapper) {
+    mapper->write_cpu(address, value);
+  }
 }
 
 
@@ -148,7 +225,7 @@ void CPU::push(uint8_t value) {
   // Stack is 0x0100 + SP, then SP--
   uint16_t addr = 0x100 + SP;
   assert(addr <= 0x1FF);
-  system_memory[addr] = value;
+  ram[addr] = value;
   if (SP == 0) {
     // Underflow case
     SP = 0xFF;
@@ -174,83 +251,34 @@ uint8_t CPU::pop() {
   }
   uint16_t addr = 0x100 + SP;
   assert(addr <= 0x1FF);
-  return system_memory[addr];
+  return ram[addr];
 }
 
 
 // function to parse and load ROM
-void CPU::loadROM(const std::string& filename) {
-  std::ifstream file(filename, std::ios::binary); //opening file in binary mode and read
-  if (!file) {
-    printf("No file found");
-  }
-  assert(file);
-  std::vector<uint8_t> header(16); // store the 16 bytes of info from header and initialize to 0 with ()
-  file.seekg(0, std::ios::beg); //start at beginning of file
-
-  // Since read can only read char* we use reinterpret cast the header pointer.
-  // Also tell it to read bytes equal to the header's size (16)
-  file.read(reinterpret_cast<char*>(header.data()), header.size());
-  if (!file) {
-    printf("can't read header");
-  }
-  
-  printf("PRG banks=%d CHR banks=%d mapper=%02X\n", header[4], header[5],
-       (header[7] & 0xF0) | ((header[6] & 0xF0) >> 4));
-  // take the 4 high and low nibbles at each flag
-  // one byte -> 76543210
-  // take first 4 bits each from the bytes in flags 6 and 7
-
-  uint8_t high_map = (header.at(7) & 0xF0);
-  uint8_t low_map = (header.at(6) & 0xF0) >> 4;
-
-  //combine into one 8-bit value
-  uint8_t map = (high_map) | low_map;
-  printf("Detected mapper: %d (high: 0x%X, low: 0x%X)\n", map, high_map, low_map);
-
-
-  //Prg-rom is where all the game's "program" is stored
-  size_t prg_size = header.at(4) * 16384; // getting the total size of PRG ROM data
-  std::vector<uint8_t> prg_data(prg_size);
-  file.read(reinterpret_cast<char*>(prg_data.data()), prg_size);
-  if (!file) {
-    printf("can't read prgdata");
-  }
-
-  // Chr-rom is the place where the graphics will pull characters and sprites from
-  // Chr is stored in $0000–$1FFF for PPU pattern table
-  size_t chr_size = header.at(5) * 8192; // getting the total size of CHR ROM data
-
-  std::vector<uint8_t> chr_data;
-  if (chr_size > 0) {
-    chr_data.resize(chr_size);
-    file.read(reinterpret_cast<char*>(chr_data.data()), chr_size);
-    if (!file) {
-      printf("can't read chrdata (expected %zu bytes)\n", chr_size);
-      return;
-    }
+bool CPU::loadROM(const std::string& filename) {
+  return loadROM(RomImage::load(filename));
 }
 
-  // look at whether the mirroring is vertical or horizontal
-  bool vertical = (header.at(6) & 0x01) != 0;
-
-  if (map == 0) {
-      mapper = new Mapper0(prg_data, chr_data, vertical);
+// plug in a cartridge. The image is shared, the CPU owns the mapper built on
+// it and loading another ROM replaces it
+bool CPU::loadROM(std::shared_ptr<const RomImage> rom) {
+  if (!rom) {
+    return false;
   }
-  else if (map == 1) {
-    mapper = new Mapper1(prg_data, chr_data, vertical);
+  Mapper* loaded = create_mapper(rom);
+  if (!loaded) {
+    fprintf(stderr, "mapper %d isn't supported\n", rom->mapper());
+    return false;
   }
+  delete mapper;
+  mapper = loaded;
 
-    uint8_t lo = mapper->read_cpu(0xFFFC);
-    uint8_t hi = mapper->read_cpu(0xFFFD);
-    reset_vector = lo | (hi << 8);
-    PC = reset_vector;
-
-    
-    printf("Reset vector = $%04X\n", reset_vector);
-    printf("NMI vector   = $%02X%02X\n", mapper->read_cpu(0xFFFB), mapper->read_cpu(0xFFFA));
-    printf("IRQ vector   = $%02X%02X\n", mapper->read_cpu(0xFFFF), mapper->read_cpu(0xFFFE));
-  file.close();
+  uint8_t lo = mapper->read_cpu(0xFFFC);
+  uint8_t hi = mapper->read_cpu(0xFFFD);
+  reset_vector = lo | (hi << 8);
+  PC = reset_vector;
+  return true;
 }
 
 void CPU::nmi() {
@@ -262,9 +290,17 @@ void CPU::nmi() {
     cycles += 7;
 }
 
+void CPU::irq() {
+    push((PC >> 8) & 0xFF);
+    push(PC & 0xFF);
+    push(P & ~FLAG_BREAK);
+    set_flag(FLAG_INTERRUPT, true);
+    PC = read(0xFFFE) | (read(0xFFFF) << 8); // jump to IRQ vector
+    cycles += 7;
+}
+
 
 uint8_t CPU::fetch() { //fetch 16 bits because opcode can go up to the 
-  assert(system_memory);
   assert(!bad_instruction);
   currentOpcode = CPU::read(PC);
   if (!opcode_table[currentOpcode]) {
@@ -288,7 +324,14 @@ void CPU::illegal_instruction() {
     bad_instruction = true; 
 }
 
+void (CPU::*CPU::opcode_table[256])() = {};
+
 void CPU::init_opcode_table() {
+  static const bool built = (build_opcode_table(), true); // thread safe, runs once
+  (void)built;
+}
+
+void CPU::build_opcode_table() {
   for (int i = 0; i < 256; ++i) {
     opcode_table[i] = &CPU::illegal_instruction;
   }
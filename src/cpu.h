@@ -7,6 +7,7 @@
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -25,19 +26,28 @@
 
 class PPU; // forward declaration to connect classes
 class Input;
+class APU;
+class StateWriter;
+class StateReader;
 class CPU {
   public:
     PPU* ppu;
     Input* input;
+    APU* apu;
     Mapper* mapper; 
 
     CPU();
+    ~CPU(); // deletes the mapper
+    CPU(const CPU&) = delete;
+    CPU& operator=(const CPU&) = delete;
     void connectPPU(PPU*);
     void connectInput(Input*);
+    void connectAPU(APU*);
     typedef void (*instruction_table)(void);
 
-    //look up table to store all functions pointers
-    void (CPU::*opcode_table[256])();
+    //look up table to store all functions pointers, one for every CPU
+    //(built once by the first CPU, only read after that)
+    static void (CPU::*opcode_table[256])();
 
     uint8_t get_A();
     uint8_t get_X();
@@ -45,8 +55,11 @@ class CPU {
     uint8_t get_SP();
     uint8_t get_P();
     uint16_t get_PC();
+    void set_PC(uint16_t); // for starting test ROMs somewhere other than the reset vector
     uint64_t& get_cycles();
     Mapper& get_mapper();
+    const uint8_t* get_ram() const { return ram; } // the 2KB at $0000-$07FF
+    bool ran_bad_instruction() const { return bad_instruction; } // the last step() hit an unimplemented opcode
     uint8_t getCurrentOpcode() const;
 
 
@@ -56,12 +69,26 @@ class CPU {
 		void write(uint16_t, uint8_t);
     void push(uint8_t);
     uint8_t pop();
-    void loadROM(const std::string&);
+    bool loadROM(const std::string&); // false if unreadable or the mapper isn't supported
+    bool loadROM(std::shared_ptr<const RomImage>); // same for an already loaded (shared) image
     uint8_t fetch();
     void step(); // Can't call it cycle since some instructions use multiple cycles
 
+    // step() with a trace policy (trace.h) shown the CPU first, the plain
+    // step() stays untouched so tracing costs nothing when it's off
+    template <typename Trace>
+    void step(Trace& trace) {
+      trace.instruction(*this);
+      step();
+    }
+
+    void save_state(StateWriter&) const;
+    bool load_state(StateReader&);
+    void copy_state_from(const CPU&); // registers and RAM, the mapper is copied on its own
+
     void nmi();
-    void init_opcode_table();
+    void irq(); // caller checks the I flag, the line is level triggered
+    static void init_opcode_table(); // the constructor calls it
 
     void illegal_instruction();
     void adc_immediate();
@@ -323,11 +350,10 @@ class CPU {
      */
     uint8_t P;
 
-    // The total memory for the cpu is 64K bytes
-    // Only the first 2k Bytes is ram Memory, but the rest
-    // are for other functionality. 0x2000 - 0x3FFF are separate memory
-    // locations for the ppu and require calling another function.
-    uint8_t system_memory[65536];
+    // The address space is 64K bytes but only the first 2k Bytes is ram
+    // Memory (mirrored up to 0x1FFF), the rest is the ppu, apu and input
+    // registers and the cartridge, which the mapper serves from $4020 up.
+    uint8_t ram[0x800];
 
     uint16_t reset_vector;
     
@@ -336,6 +362,8 @@ class CPU {
     uint64_t cycles;
 
     uint8_t currentOpcode;  // store last fetched opcode
+
+    static void build_opcode_table();
 };
 
 /*
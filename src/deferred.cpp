@@ -0,0 +1,174 @@
+#include "deferred.h"
+#include "ppu.h"
+
+DeferredRenderer::DeferredRenderer(unsigned threads, uint32_t* framebuffer_ref)
+    : pool(threads), framebuffer(framebuffer_ref) {
+}
+
+DeferredRenderer::~DeferredRenderer() {
+    finish();
+}
+
+void DeferredRenderer::add_segment(int line, const LineSegment& segment) {
+    std::vector<LineSegment>& segments = lines[line];
+    if (segment.first_dot == 0) {
+        segments.clear(); // start of the line, drop last frame's log
+    }
+    if (!segments.empty() && segments.back().first_dot == segment.first_dot) {
+        segments.back() = segment;
+        return;
+    }
+    segments.push_back(segment);
+}
+
+void DeferredRenderer::submit(int first, int last) {
+    pool.submit([this, first, last] {
+        for (int line = first; line < last; line++) {
+            render_line(line);
+        }
+    });
+}
+
+void DeferredRenderer::finish() {
+    pool.wait_idle();
+}
+
+// increment horizontal scroll, same as PPU::incX
+static void incX(uint16_t& vram_addr) {
+    if ((vram_addr & 0x001F) == 31) {
+        vram_addr &= ~0x001F;
+        vram_addr ^= 0x0400;
+    }
+    else {
+        vram_addr += 1;
+    }
+}
+
+// One pixel of a line from a snapshot. This is PPU::render() with the mapper
+// reads replaced by snapshot lookups and without the sprite 0 hit, which the
+// emulation thread already computed.
+static uint32_t render_pixel(const LineSegment& seg, const VramSnapshot& vram, uint16_t vram_addr, int xdot, int y) {
+    bool bgEnabled = (seg.mask & 0x08) != 0;
+    bool bgLeft = (seg.mask & 0x02) != 0;
+    bool sprEnabled = (seg.mask & 0x10) != 0;
+    bool sprLeft = (seg.mask & 0x04) != 0;
+    bool inLeft8 = (xdot < 8);
+
+    uint8_t background_color_index = 0;
+    uint8_t palette_high_bits = 0;
+
+    if (bgEnabled && !(inLeft8 && !bgLeft)) {
+        uint8_t coarseY = ((vram_addr >> 5) & 0x1F);
+        uint8_t name_table_XBit = ((vram_addr >> 10) & 1);
+        uint8_t name_table_YBit = ((vram_addr >> 11) & 1);
+        uint8_t fineY = ((vram_addr >> 12) & 7);
+
+        uint8_t coarseX_base = (vram_addr & 0x1F);
+        uint8_t Tilepx = (seg.x + (xdot & 7));
+        uint8_t pxInTile = (Tilepx & 7);
+        uint8_t carryTile = (Tilepx >> 3);
+
+        uint8_t localCoarseX = ((coarseX_base + carryTile) & 31);
+        uint8_t pageX = (((coarseX_base + carryTile) >> 5) & 1);
+        uint8_t name_table_X = (name_table_XBit ^ pageX);
+
+        uint16_t base_nametable = ((name_table_YBit << 1) | name_table_X) * 0x400;
+        uint8_t tile_number = vram.nametables[base_nametable + (coarseY % 30) * 32 + localCoarseX];
+
+        uint16_t bg_pattern_base = (seg.control & 0x10) ? 0x1000 : 0x0000;
+        uint16_t tile_addr = bg_pattern_base + (uint16_t)tile_number * 16 + (uint16_t)fineY;
+        uint8_t low = vram.chr[tile_addr & 0x1FFF];
+        uint8_t high = vram.chr[(tile_addr + 8) & 0x1FFF];
+        background_color_index = (((high >> (7 - pxInTile)) & 1) << 1) | ((low >> (7 - pxInTile)) & 1);
+
+        uint16_t attr_addr = (base_nametable + 0x3C0) + (((coarseY % 30) / 4) * 8) + (localCoarseX / 4);
+        int shift = (((coarseY % 4) / 2) * 2 + ((localCoarseX % 4) / 2)) * 2;
+        palette_high_bits = (vram.nametables[attr_addr & 0xFFF] >> shift) & 0x03;
+    }
+
+    uint8_t bg_palette_byte;
+    if (background_color_index == 0) {
+        bg_palette_byte = vram.palette[0];
+    }
+    else {
+        bg_palette_byte = vram.palette[((palette_high_bits << 2) | background_color_index) & 0x1F];
+    }
+    uint32_t color = PPU::nesColor(bg_palette_byte & 0x3F);
+
+    if (!sprEnabled || (inLeft8 && !sprLeft)) {
+        return color;
+    }
+
+    bool spriteMode8x16 = (seg.control & 0x20) != 0;
+    int spriteHeight = spriteMode8x16 ? 16 : 8;
+
+    for (int i = 0; i < 64; ++i) {
+        const uint8_t* sprite = &vram.oam[i * 4];
+        int sprite_y = (int)sprite[0] + 1;
+        uint8_t tile_index = sprite[1];
+        uint8_t attr = sprite[2];
+        uint8_t sprite_x = sprite[3];
+
+        if ((y < sprite_y) || (y >= (sprite_y + spriteHeight))) {
+            continue;
+        }
+        if ((xdot < sprite_x) || (xdot >= (sprite_x + 8))) {
+            continue;
+        }
+
+        int col = xdot - sprite_x;
+        int row = y - sprite_y;
+        int px = (attr & 0x40) ? (7 - col) : col;
+
+        uint16_t pattern_addr;
+        if (spriteMode8x16) {
+            uint16_t spr_base = (tile_index & 1) ? 0x1000 : 0x0000;
+            bool vertical_flip = (attr & 0x80) != 0;
+            bool topHalf = vertical_flip ? (row >= 8) : (row < 8);
+            uint8_t fineY = vertical_flip ? (7 - (row & 7)) : (row & 7);
+            uint8_t tileIndex = (tile_index & 0xFE) + (topHalf ? 0 : 1);
+            pattern_addr = spr_base + tileIndex * 16 + fineY;
+        }
+        else {
+            uint16_t spr_base = (seg.control & 0x08) ? 0x1000 : 0x0000;
+            int fineY = (attr & 0x80) ? (7 - (row & 7)) : (row & 7);
+            pattern_addr = spr_base + tile_index * 16 + fineY;
+        }
+
+        uint8_t s_low = vram.chr[pattern_addr & 0x1FFF];
+        uint8_t s_high = vram.chr[(pattern_addr + 8) & 0x1FFF];
+        uint8_t sprite_color_index = (((s_high >> (7 - px)) & 1) << 1) | ((s_low >> (7 - px)) & 1);
+        if (sprite_color_index == 0) {
+            continue;
+        }
+
+        bool behind_bg = (attr & 0x20) != 0;
+        if (!behind_bg || background_color_index == 0) {
+            uint16_t p_index = (0x10 + ((attr & 0x03) << 2) + sprite_color_index) & 0x1F;
+            if ((p_index & 0x13) == 0x10) p_index &= ~0x10; // palette mirrors
+            return PPU::nesColor(vram.palette[p_index] & 0x3F);
+        }
+    }
+    return color;
+}
+
+void DeferredRenderer::render_line(int y) const {
+    const std::vector<LineSegment>& segments = lines[y];
+    uint32_t* row = framebuffer + y * 256;
+
+    for (size_t s = 0; s < segments.size(); s++) {
+        const LineSegment& seg = segments[s];
+        int end = (s + 1 < segments.size()) ? segments[s + 1].first_dot : 256;
+        bool rendering = (seg.mask & 0x18) != 0;
+        uint16_t vram_addr = seg.vram_addr;
+
+        for (int xdot = seg.first_dot; xdot < end; xdot++) {
+            row[xdot] = render_pixel(seg, *seg.vram, vram_addr, xdot, y);
+
+            // coarse X steps after every 8th dot, as in PPU::tick
+            if (rendering && ((xdot + 1) & 7) == 0) {
+                incX(vram_addr);
+            }
+        }
+    }
+}
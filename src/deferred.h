@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "thread_pool.h"
+
+/*
+ * Deferred (after the fact) rendering of visible scanlines on a worker pool.
+ *
+ * In RENDER_DEFERRED frames the PPU itself only does timing work (sprite 0
+ * hit, overflow, vblank) and logs, per scanline, the register state each
+ * time it changes mid-line along with the dot it changed at. Everything a
+ * pixel depends on is in that state plus the VRAM/palette/OAM contents, and
+ * those are captured as immutable snapshots whenever they change during the
+ * frame. Each finished group of lines is handed to the pool right away, so
+ * pixel generation runs on other cores while emulation continues.
+ */
+
+// PPU memory as the renderer sees it at some point in the frame
+struct VramSnapshot {
+    uint8_t chr[0x2000];        // pattern tables through the mapper's current banks
+    uint8_t nametables[0x1000]; // the four logical nametables after mirroring
+    uint8_t palette[32];
+    uint8_t oam[256];
+};
+
+// PPU registers from a dot onwards, until the next segment on the line
+struct LineSegment {
+    uint16_t first_dot; // xdot 0-255
+    uint16_t vram_addr;
+    uint8_t x;
+    uint8_t control;
+    uint8_t mask;
+    std::shared_ptr<const VramSnapshot> vram;
+};
+
+class DeferredRenderer {
+public:
+    DeferredRenderer(unsigned threads, uint32_t* framebuffer);
+    ~DeferredRenderer();
+
+    // Record the state from a dot of a visible line onwards. A segment at the
+    // same dot as the previous one replaces it.
+    void add_segment(int line, const LineSegment& segment);
+
+    // queue lines [first, last) for rendering, their logs are complete
+    void submit(int first, int last);
+
+    // wait for every submitted line to be drawn
+    void finish();
+
+private:
+    void render_line(int line) const;
+
+    ThreadPool pool;
+    uint32_t* framebuffer;
+    std::vector<LineSegment> lines[240];
+};
@@ -0,0 +1,119 @@
+#include "gray.h"
+#include <algorithm>
+#include <cstring>
+#include "ppu.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// Add neighbouring columns of sums, halving n (a multiple of 16) in place.
+// Totals have to stay below 32768, they're packed with signed saturation.
+static void add_pairs(uint16_t* sums, int n) {
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    for (int i = 0; i < n; i += 16) {
+        __m128i a = _mm_load_si128((const __m128i*)(sums + i));
+        __m128i b = _mm_load_si128((const __m128i*)(sums + i + 8));
+        a = _mm_add_epi32(_mm_and_si128(a, low), _mm_srli_epi32(a, 16));
+        b = _mm_add_epi32(_mm_and_si128(b, low), _mm_srli_epi32(b, 16));
+        _mm_store_si128((__m128i*)(sums + i / 2), _mm_packs_epi32(a, b));
+    }
+}
+#endif
+
+GrayOutput::GrayOutput(int scale_factor, bool pool)
+    : scale(std::max(1, std::min(scale_factor, 240))), max_pool(pool) {
+    out_width = 256 / scale;
+    out_height = 240 / scale;
+    last.assign((size_t)out_width * out_height, 0);
+    pooled.assign((size_t)out_width * out_height, 0);
+
+    // BT.601 weights in 8.8 fixed point
+    for (int i = 0; i < 64; i++) {
+        uint32_t argb = PPU::nesColor((uint8_t)i);
+        luma_table[i] = (uint8_t)((77 * ((argb >> 16) & 0xFF) + 150 * ((argb >> 8) & 0xFF) + 29 * (argb & 0xFF)) >> 8);
+    }
+    memset(line, 0, sizeof(line));
+    memset(column_sums, 0, sizeof(column_sums));
+}
+
+void GrayOutput::clear_history() {
+    std::fill(last.begin(), last.end(), 0);
+}
+
+void GrayOutput::end_line(int y) {
+    int row = y / scale;
+    if (row >= out_height) {
+        return;
+    }
+
+    // add the line to the column totals, the first line of a row starts them
+    bool first = (y % scale) == 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 256; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+        if (!first) {
+            lo = _mm_add_epi16(lo, _mm_load_si128((const __m128i*)(column_sums + i)));
+            hi = _mm_add_epi16(hi, _mm_load_si128((const __m128i*)(column_sums + i + 8)));
+        }
+        _mm_store_si128((__m128i*)(column_sums + i), lo);
+        _mm_store_si128((__m128i*)(column_sums + i + 8), hi);
+    }
+#else
+    for (int i = 0; i < 256; i++) {
+        column_sums[i] = first ? line[i] : (uint16_t)(column_sums[i] + line[i]);
+    }
+#endif
+    if (y % scale != scale - 1) {
+        return;
+    }
+
+    // reduce the columns of the finished row, then pool with the last frame
+    uint32_t area = (uint32_t)(scale * scale);
+    uint8_t* current = &last[(size_t)row * out_width];
+    uint8_t* out = &pooled[(size_t)row * out_width];
+    uint8_t reduced[256];
+#ifdef __SSE2__
+    if (scale == 1 || scale == 2 || scale == 4 || scale == 8) {
+        // power of two: halve the columns until there's one per pixel, then
+        // divide by the area with a shift
+        int shift = 0;
+        for (int n = 256; n > out_width; n /= 2) {
+            add_pairs(column_sums, n);
+            shift += 2;
+        }
+        for (int x = 0; x < out_width; x += 16) {
+            __m128i a = _mm_srli_epi16(_mm_load_si128((const __m128i*)(column_sums + x)), shift);
+            __m128i b = _mm_srli_epi16(_mm_load_si128((const __m128i*)(column_sums + x + 8)), shift);
+            _mm_storeu_si128((__m128i*)(reduced + x), _mm_packus_epi16(a, b));
+        }
+    }
+    else
+#endif
+    for (int x = 0; x < out_width; x++) {
+        uint32_t sum = 0;
+        for (int dx = 0; dx < scale; dx++) {
+            sum += column_sums[x * scale + dx];
+        }
+        reduced[x] = (uint8_t)(sum / area);
+    }
+
+    if (!max_pool) {
+        memcpy(out, reduced, out_width);
+        return;
+    }
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 16 <= out_width; x += 16) {
+        __m128i now = _mm_loadu_si128((const __m128i*)(reduced + x));
+        __m128i before = _mm_loadu_si128((const __m128i*)(current + x));
+        _mm_storeu_si128((__m128i*)(out + x), _mm_max_epu8(now, before));
+        _mm_storeu_si128((__m128i*)(current + x), now);
+    }
+#endif
+    for (; x < out_width; x++) {
+        out[x] = std::max(reduced[x], current[x]);
+        current[x] = reduced[x];
+    }
+}
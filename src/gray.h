@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+/*
+ * Grayscale observation output for RENDER_GRAY frames: luma, box filtered
+ * down by an integer scale in both directions, instead of the ARGB
+ * framebuffer.
+ *
+ * The PPU puts each visible dot's luma into line[] and calls end_line()
+ * after dot 255. Lines are summed into per-column totals as they finish,
+ * and every scale lines the totals are reduced to one output row, so
+ * nothing of full size is ever written. All of it is SSE2 for scales 1, 2,
+ * 4 and 8; other scales reduce the columns one pixel at a time. Output rows are the max of this
+ * frame and the last one when max_pool is on, which keeps sprites that
+ * flicker on alternate frames visible. Rows and columns left over when 240
+ * or 256 isn't a multiple of scale are dropped.
+ */
+class GrayOutput {
+public:
+    GrayOutput(int scale, bool max_pool);
+
+    int width() const { return out_width; }
+    int height() const { return out_height; }
+    const uint8_t* frame() const { return pooled.data(); } // width() x height(), row major
+
+    // luma of an NES color (0-63)
+    uint8_t luma(uint8_t color) const { return luma_table[color & 0x3F]; }
+
+    // line y (0-239) of line[] is complete
+    void end_line(int y);
+
+    // forget the last frame, the next one isn't pooled with it
+    void clear_history();
+
+    uint8_t line[256]; // luma of the visible line being drawn
+
+private:
+    int scale;
+    bool max_pool;
+    int out_width;
+    int out_height;
+    uint8_t luma_table[64];
+    alignas(16) uint16_t column_sums[256]; // this row's lines added up per column
+    std::vector<uint8_t> last;   // this frame's rows so far, last frame's after that
+    std::vector<uint8_t> pooled; // what frame() returns
+};
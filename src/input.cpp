@@ -1,29 +1,10 @@
 // input.cpp
 #include "input.h"
+#include "savestate.h"
 
-void Input::update_controller(const Uint8* keys) {
-    controller1.state = 0;
-    controller2.state = 0;
-
-    // Player 1 mappings
-    if (keys[SDL_SCANCODE_Z]) controller1.state |= BUTTON_A;
-    if (keys[SDL_SCANCODE_X]) controller1.state |= BUTTON_B;
-    if (keys[SDL_SCANCODE_RSHIFT]) controller1.state |= BUTTON_SELECT;
-    if (keys[SDL_SCANCODE_RETURN]) controller1.state |= BUTTON_START;
-    if (keys[SDL_SCANCODE_UP]) controller1.state |= BUTTON_UP;
-    if (keys[SDL_SCANCODE_DOWN]) controller1.state |= BUTTON_DOWN;
-    if (keys[SDL_SCANCODE_LEFT]) controller1.state |= BUTTON_LEFT;
-    if (keys[SDL_SCANCODE_RIGHT]) controller1.state |= BUTTON_RIGHT;
-
-    // Player 2 mappings
-    if (keys[SDL_SCANCODE_V]) controller2.state |= BUTTON_A;
-    if (keys[SDL_SCANCODE_C]) controller2.state |= BUTTON_B;
-    if (keys[SDL_SCANCODE_Q]) controller2.state |= BUTTON_SELECT;
-    if (keys[SDL_SCANCODE_E]) controller2.state |= BUTTON_START;
-    if (keys[SDL_SCANCODE_W]) controller2.state |= BUTTON_UP;
-    if (keys[SDL_SCANCODE_S]) controller2.state |= BUTTON_DOWN;
-    if (keys[SDL_SCANCODE_A]) controller2.state |= BUTTON_LEFT;
-    if (keys[SDL_SCANCODE_D]) controller2.state |= BUTTON_RIGHT;
+void Input::set_buttons(uint8_t player1, uint8_t player2) {
+    controller1.state = player1;
+    controller2.state = player2;
 }
 
 
@@ -49,3 +30,27 @@ uint8_t Input::read_controller2() {
     return return_value | 0x40;
 }
 
+
+
+void Input::save_state(StateWriter& w) const {
+    w.begin_chunk(state_tag("INPT"), 1);
+    for (const NESController* c : {&controller1, &controller2}) {
+        w.put(c->state);
+        w.put(c->shift_reg);
+        w.put(c->strobe);
+    }
+    w.end_chunk();
+}
+
+bool Input::load_state(StateReader& r) {
+    uint16_t version;
+    if (!r.open_chunk(state_tag("INPT"), version) || version != 1) {
+        return false;
+    }
+    for (NESController* c : {&controller1, &controller2}) {
+        r.get(c->state);
+        r.get(c->shift_reg);
+        r.get(c->strobe);
+    }
+    return r.ok();
+}
@@ -1,7 +1,9 @@
 #pragma once
-#include <SDL2/SDL.h>
 #include <cstdint>
 
+class StateWriter;
+class StateReader;
+
 #define BUTTON_A      (1 << 0)
 #define BUTTON_B      (1 << 1)
 #define BUTTON_SELECT (1 << 2)
@@ -23,8 +25,13 @@ public:
     NESController controller1;
     NESController controller2;
 
-    void update_controller(const Uint8* keys);
+    // Button bits (BUTTON_*) for this frame, from the keyboard, a movie or
+    // the network. The core never reads host input itself.
+    void set_buttons(uint8_t player1, uint8_t player2);
     void write_strobe(uint8_t value);
     uint8_t read_controller1();
     uint8_t read_controller2();
-};
\ No newline at end of file
+
+    void save_state(StateWriter& w) const;
+    bool load_state(StateReader& r);
+};
\ No newline at end of file
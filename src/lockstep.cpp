@@ -0,0 +1,208 @@
+#include "lockstep.h"
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "console.h"
+#include "mapper.h"
+
+static const char* const SIDE_NAMES[2] = {"reference", "fast"};
+
+LockstepChecker::LockstepChecker(Console& reference, Console& fast, LockstepGranularity every)
+    : consoles{&reference, &fast}, granularity(every), traced{0, 0}, lines_checked(0), steps(0), compared(0) {
+    // the tracers only keep the last few lines, for showing with a mismatch
+    for (int side = 0; side < 2; side++) {
+        tracers[side].reset(new NestestTracer(nullptr, 256));
+        tracers[side]->on_line = [this, side](const char* line, size_t size) {
+            context[side][traced[side]++ % CONTEXT].assign(line, size);
+            return true;
+        };
+    }
+    last_scanline = reference.get_ppu().getScanline();
+}
+
+bool LockstepChecker::run_frame(uint8_t player1, uint8_t player2) {
+    if (!report.empty()) {
+        return false;
+    }
+    for (Console* console : consoles) {
+        console->set_buttons(player1, player2);
+    }
+
+    while (true) {
+        bool finished[2];
+        for (int side = 0; side < 2; side++) {
+            finished[side] = consoles[side]->step(*tracers[side]);
+        }
+        steps++;
+
+        // a frame ending on one side only shows up as a different PPU
+        // position, the check says which
+        if (!check(finished[0] || finished[1])) {
+            return false;
+        }
+        if (finished[0]) {
+            return true;
+        }
+    }
+}
+
+bool LockstepChecker::check(bool frame_end) {
+    uint16_t scanline = consoles[0]->get_ppu().getScanline();
+    bool due = frame_end || granularity == CHECK_INSTRUCTION ||
+               (granularity == CHECK_SCANLINE && scanline != last_scanline);
+    last_scanline = scanline;
+    if (!due) {
+        return true;
+    }
+    compared++;
+    if (!compare_cpu() || !compare_ram()) {
+        return false;
+    }
+
+    // Finished lines as they come when both draw while running, else the
+    // whole picture once it's done. RENDER_OFF and RENDER_GRAY frames have
+    // no picture to compare.
+    RenderMode modes[2] = {consoles[0]->get_ppu().getRenderMode(), consoles[1]->get_ppu().getRenderMode()};
+    if (frame_end) {
+        bool pictures = (modes[0] == RENDER_FULL || modes[0] == RENDER_DEFERRED) &&
+                        (modes[1] == RENDER_FULL || modes[1] == RENDER_DEFERRED);
+        int from = lines_checked;
+        lines_checked = 0;
+        return !pictures || compare_lines(from, 240);
+    }
+    if (modes[0] == RENDER_FULL && modes[1] == RENDER_FULL && scanline < 240 && scanline > lines_checked) {
+        int from = lines_checked;
+        lines_checked = scanline;
+        return compare_lines(from, scanline);
+    }
+    return true;
+}
+
+bool LockstepChecker::compare_cpu() {
+    static const char* const NAMES[] = {"PC", "A", "X", "Y", "P", "SP", "CPU cycle", "PPU frame", "PPU scanline",
+                                        "PPU dot"};
+    static const int REGISTERS = 6; // shown in hex, the rest in decimal
+    uint64_t values[2][10];
+    for (int side = 0; side < 2; side++) {
+        CPU& cpu = consoles[side]->get_cpu();
+        PPU& ppu = consoles[side]->get_ppu();
+        uint64_t* v = values[side];
+        v[0] = cpu.get_PC();
+        v[1] = cpu.get_A();
+        v[2] = cpu.get_X();
+        v[3] = cpu.get_Y();
+        v[4] = cpu.get_P();
+        v[5] = cpu.get_SP();
+        v[6] = cpu.get_cycles();
+        v[7] = ppu.getFrame();
+        v[8] = ppu.getScanline();
+        v[9] = ppu.getDot();
+    }
+
+    for (int i = 0; i < 10; i++) {
+        if (values[0][i] == values[1][i]) {
+            continue;
+        }
+        if (i < REGISTERS) {
+            fail("%s differs: reference %02llX, fast %02llX", NAMES[i], (unsigned long long)values[0][i],
+                 (unsigned long long)values[1][i]);
+        }
+        else {
+            fail("%s differs: reference %llu, fast %llu", NAMES[i], (unsigned long long)values[0][i],
+                 (unsigned long long)values[1][i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+// First differing byte of a block, and how many differ
+static bool find_difference(const uint8_t* a, const uint8_t* b, size_t size, size_t& first, size_t& count) {
+    if (std::memcmp(a, b, size) == 0) {
+        return false;
+    }
+    count = 0;
+    for (size_t i = size; i-- > 0;) {
+        if (a[i] != b[i]) {
+            first = i;
+            count++;
+        }
+    }
+    return true;
+}
+
+bool LockstepChecker::compare_ram() {
+    const uint8_t* ram[2] = {consoles[0]->get_cpu().get_ram(), consoles[1]->get_cpu().get_ram()};
+    size_t first = 0, count = 0;
+    if (find_difference(ram[0], ram[1], 0x800, first, count)) {
+        fail("RAM $%04X differs: reference %02X, fast %02X (%zu bytes differ)", (unsigned)first, ram[0][first],
+             ram[1][first], count);
+        return false;
+    }
+
+    std::vector<uint8_t>& prg_ram = consoles[0]->get_cpu().mapper->prg_ram();
+    std::vector<uint8_t>& other = consoles[1]->get_cpu().mapper->prg_ram();
+    if (prg_ram.size() != other.size()) {
+        fail("PRG-RAM size differs: reference %zu, fast %zu", prg_ram.size(), other.size());
+        return false;
+    }
+    if (find_difference(prg_ram.data(), other.data(), prg_ram.size(), first, count)) {
+        fail("PRG-RAM $%04X differs: reference %02X, fast %02X (%zu bytes differ)", (unsigned)(0x6000 + first),
+             prg_ram[first], other[first], count);
+        return false;
+    }
+    return true;
+}
+
+bool LockstepChecker::compare_lines(int from, int to) {
+    const uint32_t* pixels[2] = {consoles[0]->framebuffer(), consoles[1]->framebuffer()};
+    for (int y = from; y < to; y++) {
+        const uint32_t* a = pixels[0] + y * 256;
+        const uint32_t* b = pixels[1] + y * 256;
+        if (std::memcmp(a, b, 256 * sizeof(uint32_t)) == 0) {
+            continue;
+        }
+        int first = -1, count = 0;
+        for (int x = 0; x < 256; x++) {
+            if (a[x] != b[x]) {
+                first = (first < 0) ? x : first;
+                count++;
+            }
+        }
+        fail("pixel %d,%d differs: reference %06X, fast %06X (%d pixels differ on the line)", first, y,
+             (unsigned)(a[first] & 0xFFFFFF), (unsigned)(b[first] & 0xFFFFFF), count);
+        return false;
+    }
+    return true;
+}
+
+// Where both machines are, what differs, and the last instructions of each
+void LockstepChecker::fail(const char* format, ...) {
+    char what[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(what, sizeof(what), format, args);
+    va_end(args);
+
+    PPU& ppu = consoles[0]->get_ppu();
+    char text[512];
+    snprintf(text, sizeof(text), "frame %llu, scanline %u dot %u, instruction %llu: %s\n",
+             (unsigned long long)ppu.getFrame(), (unsigned)ppu.getScanline(), (unsigned)ppu.getDot(),
+             (unsigned long long)steps, what);
+    report = text;
+    if (granularity != CHECK_INSTRUCTION) {
+        report += granularity == CHECK_SCANLINE ? "(compared once a line, " : "(compared once a frame, ";
+        report += "the difference may have started earlier)\n";
+    }
+
+    for (int side = 0; side < 2; side++) {
+        report += "last instructions, ";
+        report += SIDE_NAMES[side];
+        report += ":\n";
+        uint64_t first = traced[side] > CONTEXT ? traced[side] - CONTEXT : 0;
+        for (uint64_t n = first; n < traced[side]; n++) {
+            report += "  " + context[side][n % CONTEXT] + "\n";
+        }
+    }
+}
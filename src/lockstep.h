@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "trace.h"
+
+class Console;
+
+// How often LockstepChecker compares the two machines
+enum LockstepGranularity {
+    CHECK_INSTRUCTION, // after every instruction
+    CHECK_SCANLINE,    // whenever the PPU starts a new line
+    CHECK_FRAME        // at the end of each frame
+};
+
+/*
+ * Debug mode for fast paths. Runs two consoles side by side, one set up to
+ * take the reference path (per-dot PPU, full rendering, no caches) and one
+ * taking the optimized path under test, one instruction at a time each,
+ * and compares them as they go: CPU registers, cycle count and PPU
+ * position, the 2KB of RAM and PRG-RAM, and the lines of the framebuffer
+ * finished so far (at the end of the frame only, when either one renders
+ * deferred). The first difference stops both right there and is described
+ * by mismatch(), with the instructions each one ran last.
+ *
+ * Which paths each console takes is up to its settings (render mode,
+ * enableBackgroundCache, enableIdleSkip, ...), the checker only drives
+ * and compares. Both have to start in the same state: the same ROM, and
+ * both just powered on or loaded from the same save state.
+ */
+class LockstepChecker {
+public:
+    static constexpr int CONTEXT = 8; // instructions shown before a mismatch
+
+    LockstepChecker(Console& reference, Console& fast, LockstepGranularity every);
+    LockstepChecker(const LockstepChecker&) = delete;
+    LockstepChecker& operator=(const LockstepChecker&) = delete;
+
+    // Run a frame on both with the same buttons. false at the first
+    // mismatch, the consoles stay where it was found.
+    bool run_frame(uint8_t player1, uint8_t player2);
+
+    const std::string& mismatch() const { return report; }
+    uint64_t instructions() const { return steps; }
+    uint64_t checks() const { return compared; }
+
+private:
+    bool check(bool frame_end);
+    bool compare_cpu();
+    bool compare_ram();
+    bool compare_lines(int from, int to);
+    void fail(const char* format, ...);
+
+    Console* consoles[2]; // reference, fast
+    LockstepGranularity granularity;
+    std::unique_ptr<NestestTracer> tracers[2];
+    std::string context[2][CONTEXT]; // last traced lines, instruction n in slot n % CONTEXT
+    uint64_t traced[2];
+    uint16_t last_scanline;
+    int lines_checked; // framebuffer lines of this frame compared so far
+    uint64_t steps;
+    uint64_t compared;
+    std::string report;
+};
@@ -1,34 +1,51 @@
 #include "mapper.h"
+#include "savestate.h"
 
-Mapper0::Mapper0(std::vector<uint8_t> prg, std::vector<uint8_t> chr, bool vertical)
-    : prgROM(prg), chrROM(chr), vertical_mirror(vertical) 
+Mapper* create_mapper(std::shared_ptr<const RomImage> rom) {
+    switch (rom->mapper()) {
+        case 0: return new Mapper0(rom);
+        case 1: return new Mapper1(rom);
+    }
+    return nullptr;
+}
+
+Mapper0::Mapper0(std::shared_ptr<const RomImage> rom_ref)
+    : Mapper(rom_ref), prgROM(rom_ref->prg()), prg_size(rom_ref->prg_size()), chr(rom_ref->chr()),
+      vertical_mirror(rom_ref->vertical_mirroring()), chr_ram(rom_ref->chr_size() == 0)
 {
     // allocate 2KB for nametables (4 nametables * 1KB each mirrored)
     nametables.resize(0x800, 0);
-    if (chrROM.empty()) {
-        chrROM.resize(0x2000, 0);
+    // iNES headers don't reliably say whether there's PRG-RAM, give every board 8KB
+    prgRAM.resize(0x2000, 0);
+    if (chr_ram) {
+        chrRAM.resize(0x2000, 0);
+        chr = chrRAM.data();
     }
 }
 
 uint8_t Mapper0::read_cpu(uint16_t addr) {
     if (addr >= 0x8000) {
-        if (prgROM.size() == 0x4000) 
+        if (prg_size == 0x4000) 
             return prgROM[(addr - 0x8000) % 0x4000];
         else
             return prgROM[addr - 0x8000];
     }
+    if (addr >= 0x6000) {
+        return prgRAM[addr - 0x6000];
+    }
     return 0;
 }
 
 void Mapper0::write_cpu(uint16_t addr, uint8_t data) {
-    (void)addr;
-    (void)data;
+    if (addr >= 0x6000 && addr < 0x8000) {
+        prgRAM[addr - 0x6000] = data;
+    }
 }
 
 uint8_t Mapper0::read_ppu(uint16_t addr) {
     if (addr < 0x2000) {
         // CHR ROM/RAM
-        return chrROM[addr];
+        return chr[addr];
     } else if (addr >= 0x2000 && addr < 0x3000) {
         // nametable reads with mirroring
         uint16_t mirrored = mirrorAddress(addr, vertical_mirror);
@@ -42,9 +59,9 @@ uint8_t Mapper0::read_ppu(uint16_t addr) {
 }
 
 void Mapper0::write_ppu(uint16_t addr, uint8_t data) {
-    if (addr < 0x2000 && !chrROM.empty()) {
-        // CHR-RAM
-        chrROM[addr] = data;
+    if (addr < 0x2000) {
+        // CHR-RAM, CHR-ROM ignores the write
+        if (chr_ram) chrRAM[addr] = data;
     } else if (addr >= 0x2000 && addr < 0x3000) {
         // nametable write with mirroring
         uint16_t mirrored = mirrorAddress(addr, vertical_mirror);
@@ -68,6 +85,43 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
     }
 }
 
+void Mapper0::save_state(StateWriter& w) const {
+    w.begin_chunk(state_tag("MAP0"), 1);
+    w.write(prgRAM.data(), prgRAM.size());
+    w.write(nametables.data(), nametables.size());
+    if (chr_ram) {
+        w.write(chrRAM.data(), chrRAM.size());
+    }
+    w.end_chunk();
+}
+
+bool Mapper0::load_state(StateReader& r) {
+    uint16_t version;
+    if (!r.open_chunk(state_tag("MAP0"), version) || version != 1) {
+        return false;
+    }
+    r.read(prgRAM.data(), prgRAM.size());
+    r.read(nametables.data(), nametables.size());
+    if (chr_ram) {
+        r.read(chrRAM.data(), chrRAM.size());
+    }
+    ppu_map_changes++;
+    return r.ok();
+}
+
+bool Mapper0::copy_state_from(const Mapper& other) {
+    const Mapper0* from = dynamic_cast<const Mapper0*>(&other);
+    if (!from || from->prg_size != prg_size || from->chr_ram != chr_ram) {
+        return false;
+    }
+    // same sizes, so these copy without allocating
+    prgRAM = from->prgRAM;
+    nametables = from->nametables;
+    chrRAM = from->chrRAM;
+    ppu_map_changes++;
+    return true;
+}
+
 
 
 
@@ -75,7 +129,7 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
 
     void Mapper1::update_banks() {
         uint8_t prg_mode = (control >> 2) & 0x03;
-        size_t num_banks = prgROM.size() / 0x4000;
+        size_t num_banks = prg_size / 0x4000;
         if (!num_banks) {
             prg_bank_low = prg_bank_high = 0; 
             return;
@@ -121,17 +175,17 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
     }
 
 
-    Mapper1::Mapper1(std::vector<uint8_t> prg, std::vector<uint8_t> chr, bool vertical)
-        : prgROM(prg), chrROM(chr), vertical_mirror(vertical) {
+    Mapper1::Mapper1(std::shared_ptr<const RomImage> rom_ref)
+        : Mapper(rom_ref), prgROM(rom_ref->prg()), prg_size(rom_ref->prg_size()), chrROM(rom_ref->chr()),
+          chr_size(rom_ref->chr_size()), vertical_mirror(rom_ref->vertical_mirroring()) {
         nametables.resize(0x800, 0);
-        palette.resize(32, 0);
         prgRAM.resize(0x2000, 0); 
         shift_reg = 0x10;
         write_count = 0;
         control = 0x0C;
         prg_ram_enable = true;
-        prg_bank_high = (prgROM.size() / 0x4000) - 1;
-        if (chrROM.empty()) {
+        prg_bank_high = (prg_size / 0x4000) - 1;
+        if (chr_size == 0) {
           chrRAM.resize(0x2000, 0);
         }
         
@@ -140,7 +194,6 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
 
     uint8_t Mapper1::read_cpu(uint16_t addr) {
         if (addr >= 0x6000 && addr < 0x8000) {
-            printf("[PRG-RAM R] %04X -> %02X\n", addr, prgRAM[addr-0x6000]);
             return prgRAM[addr - 0x6000];
         }
         if (addr < 0x8000) {
@@ -154,11 +207,11 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
             offset = (addr - 0xC000) + (prg_bank_high * 0x4000);
         }
 
-        if (prgROM.empty()) {
+        if (prg_size == 0) {
             return 0xFF;
         }
 
-        offset %= prgROM.size();
+        offset %= prg_size;
         return prgROM[offset];
     }
 
@@ -193,12 +246,22 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
             uint8_t value = shift_reg & 0x1F;
             switch ((addr >> 13) & 0x03) {
                 case 0: 
+                    // mirroring (bits 0-1) or CHR mode (bit 4) changed
+                    if ((control ^ value) & 0x13) {
+                        ppu_map_changes++;
+                    }
                     control = value;
                     break; 
                 case 1: 
+                    if (chr_bank0 != value) {
+                        ppu_map_changes++;
+                    }
                     chr_bank0 = value;
                     break; 
                 case 2: 
+                    if (chr_bank1 != value) {
+                        ppu_map_changes++;
+                    }
                     chr_bank1 = value;
                     break; 
                 case 3:
@@ -219,24 +282,24 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
         if (addr < 0x2000) {
             
             uint8_t chr_mode = (control >> 4) & 1;
-            if (chrROM.empty()) {
+            if (chr_size == 0) {
                 return chrRAM[addr & 0x1FFF];
             } else {
                 if (chr_mode == 0) {
                     // 8 KB mode
                     uint32_t bank_index = (chr_bank0 & 0x1E);
                     uint32_t bank_offset = bank_index * 0x1000; // bank_index counts in 4KB units
-                    uint32_t idx = (bank_offset + (addr & 0x1FFF)) % chrROM.size();
+                    uint32_t idx = (bank_offset + (addr & 0x1FFF)) % chr_size;
                     return chrROM[idx];
                 } else {
                     // 4 KB mode
                     if (addr < 0x1000) {
                         uint32_t bank_offset = (uint32_t)(chr_bank0 & 0x1F) * 0x1000;
-                        uint32_t idx = (bank_offset + (addr & 0x0FFF)) % chrROM.size();
+                        uint32_t idx = (bank_offset + (addr & 0x0FFF)) % chr_size;
                         return chrROM[idx];
                     } else {
                         uint32_t bank_offset = (uint32_t)(chr_bank1 & 0x1F) * 0x1000;
-                        uint32_t idx = (bank_offset + (addr & 0x0FFF)) % chrROM.size();
+                        uint32_t idx = (bank_offset + (addr & 0x0FFF)) % chr_size;
                         return chrROM[idx];
                     }
                 }
@@ -245,11 +308,7 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
         else if (addr < 0x3F00) {
             return nametables[mirrorAddress(addr)];
         }
-        else {
-            uint16_t index = addr & 0x1F;         
-            if ((index & 0x03) == 0) index &= 0x0F;
-            return palette[index];
-        }
+        return 0; // palette, the PPU answers that itself
     }
 
 
@@ -258,18 +317,69 @@ uint16_t Mapper0::mirrorAddress(uint16_t addr, bool verticalMirror) {
         addr &= 0x3FFF; // mirroring
 
         if (addr < 0x2000) {
-            if (chrROM.empty()) {
+            if (chr_size == 0) {
                 chrRAM[addr & 0x1FFF] = data;
             }
         }
         else if (addr < 0x3F00) {
             nametables[mirrorAddress(addr)] = data;
         }
-        else {
-            uint16_t index = addr & 0x1F;
-            if ((index & 0x03) == 0) index &= 0x0F; 
-            palette[index] = data;
-        }
     }
 
 
+
+    void Mapper1::save_state(StateWriter& w) const {
+        w.begin_chunk(state_tag("MAP1"), 1);
+        w.put(shift_reg);
+        w.put(write_count);
+        w.put(control);
+        w.put(chr_bank0);
+        w.put(chr_bank1);
+        w.put(prg_bank);
+        w.put(prg_ram_enable);
+        w.write(prgRAM.data(), prgRAM.size());
+        w.write(nametables.data(), nametables.size());
+        w.write(chrRAM.data(), chrRAM.size()); // empty on CHR-ROM boards
+        w.end_chunk();
+    }
+
+    bool Mapper1::load_state(StateReader& r) {
+        uint16_t version;
+        if (!r.open_chunk(state_tag("MAP1"), version) || version != 1) {
+            return false;
+        }
+        r.get(shift_reg);
+        r.get(write_count);
+        r.get(control);
+        r.get(chr_bank0);
+        r.get(chr_bank1);
+        r.get(prg_bank);
+        r.get(prg_ram_enable);
+        r.read(prgRAM.data(), prgRAM.size());
+        r.read(nametables.data(), nametables.size());
+        r.read(chrRAM.data(), chrRAM.size());
+        update_banks();
+        ppu_map_changes++;
+        return r.ok();
+    }
+
+    bool Mapper1::copy_state_from(const Mapper& other) {
+        const Mapper1* from = dynamic_cast<const Mapper1*>(&other);
+        if (!from || from->prg_size != prg_size || from->chr_size != chr_size) {
+            return false;
+        }
+        shift_reg = from->shift_reg;
+        write_count = from->write_count;
+        control = from->control;
+        chr_bank0 = from->chr_bank0;
+        chr_bank1 = from->chr_bank1;
+        prg_bank = from->prg_bank;
+        prg_bank_low = from->prg_bank_low;
+        prg_bank_high = from->prg_bank_high;
+        prg_ram_enable = from->prg_ram_enable;
+        prgRAM = from->prgRAM;
+        nametables = from->nametables;
+        chrRAM = from->chrRAM;
+        ppu_map_changes++;
+        return true;
+    }
@@ -1,8 +1,13 @@
 #pragma once
 #include <cstdlib>
 #include <stdint.h>
+#include <memory>
 #include <vector>
 #include <cstdio>
+#include "rom.h"
+
+class StateWriter;
+class StateReader;
 
 class Mapper {
 public:
@@ -11,30 +16,64 @@ public:
     virtual uint8_t read_ppu(uint16_t addr) = 0;
     virtual void write_ppu(uint16_t addr, uint8_t data) = 0;
     virtual ~Mapper() = default;
+
+    // Banking registers and writable memory, see savestate.h. Loading fails
+    // on a chunk written by another mapper.
+    virtual void save_state(StateWriter& w) const = 0;
+    virtual bool load_state(StateReader& r) = 0;
+
+    // Take over another mapper's registers and RAM, the ROM stays shared.
+    // false if it's another kind of mapper or board.
+    virtual bool copy_state_from(const Mapper& other) = 0;
+
+    // Bumped whenever CHR banking or nametable mirroring changes, so anything
+    // caching pattern/nametable data on the PPU side knows to refresh.
+    uint32_t ppu_map_version() const { return ppu_map_changes; }
+
+    // Cartridge RAM at $6000-$7FFF, 8KB on boards that have it, else empty
+    std::vector<uint8_t>& prg_ram() { return prgRAM; }
+
+    const std::shared_ptr<const RomImage>& rom_image() const { return rom; }
+
+protected:
+    explicit Mapper(std::shared_ptr<const RomImage> rom_ref) : rom(rom_ref) {}
+
+    std::shared_ptr<const RomImage> rom; // shared, read only
+    uint32_t ppu_map_changes = 0;
+    std::vector<uint8_t> prgRAM;
 };
 
+// Mapper for the board the image asks for, nullptr if it isn't supported
+Mapper* create_mapper(std::shared_ptr<const RomImage> rom);
+
 // Mapper0 / NROM
 class Mapper0 : public Mapper {
-    std::vector<uint8_t> prgROM; //prgROM is the actual program
-    std::vector<uint8_t> chrROM; //chrROM is the sprites/characters
+    const uint8_t* prgROM; //prgROM is the actual program
+    size_t prg_size;
+    const uint8_t* chr; //chr is the sprites/characters, in the ROM or chrRAM
+    std::vector<uint8_t> chrRAM; // 8KB when the board has no CHR-ROM
     std::vector<uint8_t> nametables; //Table to layout every tile and to map everything
     bool vertical_mirror;
+    bool chr_ram; // board has no CHR-ROM
     uint16_t mirrorAddress(uint16_t addr, bool verticalMirror); // finds mirrored nametable based on address
 
 public:
-    Mapper0(std::vector<uint8_t> prg, std::vector<uint8_t> chr, bool vertical);
+    explicit Mapper0(std::shared_ptr<const RomImage> rom);
     uint8_t read_cpu(uint16_t addr) override;
     void write_cpu(uint16_t addr, uint8_t data) override;
     uint8_t read_ppu(uint16_t addr) override;
     void write_ppu(uint16_t addr, uint8_t data) override;
+    void save_state(StateWriter& w) const override;
+    bool load_state(StateReader& r) override;
+    bool copy_state_from(const Mapper& other) override;
 };
 
 class Mapper1 : public Mapper {
 private:
-    std::vector<uint8_t> prgROM;
-    std::vector<uint8_t> chrROM;
-    std::vector<uint8_t> palette;
-    std::vector<uint8_t> prgRAM;
+    const uint8_t* prgROM;
+    size_t prg_size;
+    const uint8_t* chrROM;
+    size_t chr_size; // 0 when the board has CHR-RAM
     std::vector<uint8_t> chrRAM; 
     std::vector<uint8_t> nametables;
 
@@ -61,8 +100,8 @@ private:
 
 public:
 
-    // Constructor: Initializes the mapper with PRG/CHR data and the board's default mirroring.
-    Mapper1(std::vector<uint8_t> prg, std::vector<uint8_t> chr, bool vertical);
+    // Constructor: Initializes the mapper with the shared PRG/CHR data and the board's default mirroring.
+    explicit Mapper1(std::shared_ptr<const RomImage> rom);
 
     // Reads a byte from the CPU address space ($6000-$FFFF).
     uint8_t read_cpu(uint16_t addr) override;
@@ -71,9 +110,14 @@ public:
     // Writes in the $8000-$FFFF range control the MMC1 shift register.
     void write_cpu(uint16_t addr, uint8_t data) override;
 
-    // Reads a byte from the PPU address space (VRAM, CHR, Palette).
+    // Reads a byte from the PPU address space (CHR and nametables, the PPU keeps the palette).
     uint8_t read_ppu(uint16_t addr) override;
 
-    // Writes a byte to the PPU address space (VRAM, CHR-RAM, Palette).
+    // Writes a byte to the PPU address space (CHR-RAM and nametables).
     void write_ppu(uint16_t addr, uint8_t data) override;
-};
\ No newline at end of file
+
+    // Registers, PRG-RAM, CHR-RAM and nametables.
+    void save_state(StateWriter& w) const override;
+    bool load_state(StateReader& r) override;
+    bool copy_state_from(const Mapper& other) override;
+};
\ No newline at end of file
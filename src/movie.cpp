@@ -0,0 +1,136 @@
+#include "movie.h"
+#include <cstdio>
+#include <cstring>
+
+static const uint8_t MOVIE_MAGIC[4] = {'N', 'E', 'S', 'M'};
+static const int RUN_BYTES = 4; // longest varint for a run
+static const size_t MAX_RUN = ((size_t)1 << (7 * RUN_BYTES)) - 1;
+
+static std::vector<uint8_t> read_file(const char* path, bool& ok) {
+    std::vector<uint8_t> data;
+    FILE* f = fopen(path, "rb");
+    ok = (f != nullptr);
+    if (!f) {
+        return data;
+    }
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.insert(data.end(), chunk, chunk + got);
+    }
+    fclose(f);
+    return data;
+}
+
+template <typename T>
+static void put(std::vector<uint8_t>& out, T value) {
+    const uint8_t* p = (const uint8_t*)&value;
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+template <typename T>
+static bool get(const std::vector<uint8_t>& in, size_t& pos, T& value) {
+    if (in.size() - pos < sizeof(T)) {
+        return false;
+    }
+    std::memcpy(&value, &in[pos], sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+uint64_t rom_file_hash(const char* path) {
+    bool ok;
+    std::vector<uint8_t> rom = read_file(path, ok);
+    if (!ok) {
+        return 0;
+    }
+    uint64_t hash = 1469598103934665603ULL;
+    for (uint8_t b : rom) {
+        hash = (hash ^ b) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void Movie::record(uint8_t player1, uint8_t player2) {
+    frames.push_back((uint16_t)(player1 | (player2 << 8)));
+}
+
+bool Movie::save(const std::string& path) const {
+    std::vector<uint8_t> out;
+    out.insert(out.end(), MOVIE_MAGIC, MOVIE_MAGIC + 4);
+    put(out, MOVIE_FORMAT_VERSION);
+    put(out, rom_hash);
+    put(out, (uint32_t)frames.size());
+    put(out, (uint32_t)start_state.size());
+    out.insert(out.end(), start_state.begin(), start_state.end());
+
+    for (size_t i = 0; i < frames.size();) {
+        size_t run = 1;
+        while (i + run < frames.size() && run < MAX_RUN && frames[i + run] == frames[i]) {
+            run++;
+        }
+        for (size_t v = run; ; v >>= 7) {
+            if (v < 0x80) {
+                out.push_back((uint8_t)v);
+                break;
+            }
+            out.push_back((uint8_t)(v | 0x80));
+        }
+        put(out, frames[i]);
+        i += run;
+    }
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    fclose(f);
+    return ok;
+}
+
+bool Movie::load(const std::string& path) {
+    bool ok;
+    std::vector<uint8_t> in = read_file(path.c_str(), ok);
+    if (!ok || in.size() < 4 || std::memcmp(in.data(), MOVIE_MAGIC, 4) != 0) {
+        return false;
+    }
+
+    size_t pos = 4;
+    uint32_t version, count, state_size;
+    if (!get(in, pos, version) || version != MOVIE_FORMAT_VERSION ||
+        !get(in, pos, rom_hash) || !get(in, pos, count) || !get(in, pos, state_size) ||
+        in.size() - pos < state_size) {
+        return false;
+    }
+    start_state.assign(in.begin() + pos, in.begin() + pos + state_size);
+    pos += state_size;
+
+    // every run takes at least 3 bytes, so the count has to fit in what's
+    // left of the file; it isn't trusted any further than that
+    if (count > (uint64_t)((in.size() - pos) / 3) * MAX_RUN) {
+        return false;
+    }
+    frames.clear();
+    while (pos < in.size()) {
+        size_t run = 0;
+        int shift = 0;
+        while (pos < in.size() && (in[pos] & 0x80)) {
+            if (shift == 7 * (RUN_BYTES - 1)) {
+                return false;
+            }
+            run |= (size_t)(in[pos++] & 0x7F) << shift;
+            shift += 7;
+        }
+        uint16_t buttons;
+        if (pos >= in.size()) {
+            return false;
+        }
+        run |= (size_t)in[pos++] << shift;
+        if (!get(in, pos, buttons) || frames.size() + run > count) {
+            return false;
+        }
+        frames.insert(frames.end(), run, buttons);
+    }
+    return frames.size() == count;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Input movie: the controller state of every frame from a start state on.
+ * Emulation is deterministic, so loading the start state and feeding the same
+ * buttons frame by frame replays a session exactly.
+ *
+ *   header: "NESM", uint32 format version, uint64 ROM hash, uint32 frame count
+ *   start:  uint32 size, then a save state (see savestate.h)
+ *   input:  runs of (varint frames, uint8 player 1, uint8 player 2), a run
+ *           up to 4 varint bytes (2^28 - 1 frames)
+ *
+ * Buttons tend to be held for many frames, so the runs keep a movie to a
+ * few bytes per second of play.
+ */
+
+static constexpr uint32_t MOVIE_FORMAT_VERSION = 1;
+
+// FNV-1a of the ROM file, 0 if it can't be read
+uint64_t rom_file_hash(const char* path);
+
+class Movie {
+public:
+    uint64_t rom_hash = 0;
+    std::vector<uint8_t> start_state;
+    std::vector<uint16_t> frames; // player 1 buttons in the low byte, player 2 in the high
+
+    void record(uint8_t player1, uint8_t player2);
+    size_t length() const { return frames.size(); }
+    uint8_t player1(size_t frame) const { return (uint8_t)frames[frame]; }
+    uint8_t player2(size_t frame) const { return (uint8_t)(frames[frame] >> 8); }
+
+    bool save(const std::string& path) const;
+    bool load(const std::string& path); // false if missing or malformed
+};
@@ -0,0 +1,135 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "console.h"
+#include "lockstep.h"
+#include "movie.h"
+
+/*
+ * Runs a ROM on the reference path and the fast path side by side with the
+ * lockstep checker and stops at the first place they disagree.
+ *
+ *   nes_lockstep [--every instruction|scanline|frame] [--frames N]
+ *                [--movie file.nesm] [--deferred THREADS] [--no-bg-cache]
+ *                [--no-idle-skip] rom
+ *
+ * The reference renders every frame in full, ticks the PPU dot by dot and
+ * has no background cache. The fast one skips idle PPU dots and uses the
+ * background cache, or renders deferred on worker threads with --deferred;
+ * --no-bg-cache and --no-idle-skip turn single fast paths off to narrow a
+ * difference down. Input comes from the movie, if there is one, else no
+ * buttons are pressed. Exits 1 on a mismatch.
+ */
+
+static const int DEFAULT_FRAMES = 600;
+
+static void usage() {
+    fprintf(stderr, "usage: nes_lockstep [--every instruction|scanline|frame] [--frames N] [--movie file]\n"
+                    "                    [--deferred THREADS] [--no-bg-cache] [--no-idle-skip] rom\n");
+}
+
+int main(int argc, char* argv[]) {
+    LockstepGranularity every = CHECK_SCANLINE;
+    long frames = -1;
+    const char* movie_path = nullptr;
+    const char* rom_path = nullptr;
+    unsigned deferred_threads = 0;
+    bool bg_cache = true;
+    bool idle_skip = true;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+            const char* what = argv[++i];
+            if (strcmp(what, "instruction") == 0) {
+                every = CHECK_INSTRUCTION;
+            }
+            else if (strcmp(what, "scanline") == 0) {
+                every = CHECK_SCANLINE;
+            }
+            else if (strcmp(what, "frame") == 0) {
+                every = CHECK_FRAME;
+            }
+            else {
+                fprintf(stderr, "--every takes instruction, scanline or frame\n");
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtol(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc) {
+            movie_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--deferred") == 0 && i + 1 < argc) {
+            deferred_threads = (unsigned)strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--no-bg-cache") == 0) {
+            bg_cache = false;
+        }
+        else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+            idle_skip = false;
+        }
+        else if (argv[i][0] != '-' && !rom_path) {
+            rom_path = argv[i];
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (!rom_path) {
+        usage();
+        return 2;
+    }
+
+    std::unique_ptr<Console> reference(new Console());
+    if (!reference->load_rom(rom_path)) {
+        return 2;
+    }
+    Movie movie;
+    if (movie_path) {
+        if (!movie.load(movie_path)) {
+            fprintf(stderr, "couldn't read movie %s\n", movie_path);
+            return 2;
+        }
+        if (movie.rom_hash != rom_file_hash(rom_path)) {
+            fprintf(stderr, "%s was recorded with a different ROM\n", movie_path);
+            return 2;
+        }
+        if (!reference->load_state(movie.start_state.data(), movie.start_state.size())) {
+            fprintf(stderr, "%s has a broken start state\n", movie_path);
+            return 2;
+        }
+    }
+    std::unique_ptr<Console> fast = reference->clone();
+    if (frames < 0) {
+        frames = movie_path ? (long)movie.frames.size() : DEFAULT_FRAMES;
+    }
+
+    reference->get_apu().set_muted(true);
+    reference->get_ppu().setRenderMode(RENDER_FULL);
+    reference->get_ppu().enableIdleSkip(false);
+    fast->get_apu().set_muted(true);
+    fast->get_ppu().enableIdleSkip(idle_skip);
+    if (deferred_threads > 0) {
+        fast->get_ppu().enableDeferredRender(deferred_threads);
+        fast->get_ppu().setRenderMode(RENDER_DEFERRED);
+    }
+    else {
+        fast->get_ppu().enableBackgroundCache(bg_cache);
+        fast->get_ppu().setRenderMode(RENDER_FULL);
+    }
+
+    LockstepChecker checker(*reference, *fast, every);
+    for (long frame = 0; frame < frames; frame++) {
+        uint16_t buttons = (size_t)frame < movie.frames.size() ? movie.frames[frame] : 0;
+        if (!checker.run_frame(buttons & 0xFF, buttons >> 8)) {
+            printf("%s", checker.mismatch().c_str());
+            return 1;
+        }
+    }
+    printf("%ld frames, %llu instructions, %llu checks: the paths agree\n", frames,
+           (unsigned long long)checker.instructions(), (unsigned long long)checker.checks());
+    return 0;
+}
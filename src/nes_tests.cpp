@@ -0,0 +1,237 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "console.h"
+#include "work_stealing.h"
+
+/*
+ * Headless runner for the test ROMs in testing/. Every ROM gets its own
+ * console and they all run at once on a WorkStealingPool, with drawing off
+ * except for the frames a hash is taken of. How each ROM reports:
+ *
+ *   BLARGG_6000   newer blargg tests: $6001-$6003 hold DE B0 61 once the
+ *                 test runs, $6000 is $80 while it runs and then the result
+ *                 (0 = passed), with text from $6004
+ *   RESULT_BYTE   2005 blargg PPU tests: a code in zero page after the
+ *                 frame budget (1 = passed)
+ *   SCREEN_TEXT   passed once the nametable shows a text, unless it also
+ *                 shows one of the failure texts
+ *   FRAME_HASH    the picture after the frame budget has a known hash, for
+ *                 tests whose result is only a picture (the hash is of a
+ *                 frame checked by eye)
+ *
+ * Tests this emulator doesn't pass yet are KNOWN_FAIL, so the run fails
+ * only when a result changes. Exit code 0 when nothing did.
+ */
+
+enum Check { BLARGG_6000, RESULT_BYTE, SCREEN_TEXT, FRAME_HASH };
+enum Expect { PASS, KNOWN_FAIL };
+
+struct RomTest {
+    const char* rom;
+    Check check;
+    int frames;            // timeout, or when the result is read for RESULT_BYTE/FRAME_HASH
+    Expect expect;
+    uint16_t address;      // RESULT_BYTE
+    const char* text;      // SCREEN_TEXT pass text
+    const char* fail[3];   // SCREEN_TEXT failure texts
+    uint64_t hash;         // FRAME_HASH
+    int press_start;       // frame to press Start at, -1 for never
+};
+
+static const RomTest TESTS[] = {
+    {"01-basics.nes", BLARGG_6000, 600, PASS, 0, nullptr, {}, 0, -1},
+    {"instr_misc.nes", BLARGG_6000, 600, KNOWN_FAIL, 0, nullptr, {}, 0, -1},
+    {"oam_read.nes", BLARGG_6000, 600, PASS, 0, nullptr, {}, 0, -1},
+    {"oam_stress.nes", BLARGG_6000, 1200, KNOWN_FAIL, 0, nullptr, {}, 0, -1},
+    {"official_only.nes", BLARGG_6000, 3000, PASS, 0, nullptr, {}, 0, -1},
+    {"ppu_open_bus.nes", BLARGG_6000, 600, KNOWN_FAIL, 0, nullptr, {}, 0, -1},
+    {"palette_ram.nes", RESULT_BYTE, 60, PASS, 0xF0, nullptr, {}, 0, -1},
+    {"sprite_ram.nes", RESULT_BYTE, 60, PASS, 0xF0, nullptr, {}, 0, -1},
+    {"vram_access.nes", RESULT_BYTE, 60, PASS, 0xF0, nullptr, {}, 0, -1},
+    {"power_up_palette.nes", RESULT_BYTE, 60, KNOWN_FAIL, 0xF0, nullptr, {}, 0, -1},
+    {"vbl_clear_time.nes", RESULT_BYTE, 60, KNOWN_FAIL, 0xF0, nullptr, {}, 0, -1},
+    {"1.Branch_Basics.nes", SCREEN_TEXT, 120, PASS, 0, "PASSED", {"FAILED", "ERROR"}, 0, -1},
+    {"2.Backward_Branch.nes", SCREEN_TEXT, 120, PASS, 0, "PASSED", {"FAILED", "ERROR"}, 0, -1},
+    {"3.Forward_Branch.nes", SCREEN_TEXT, 120, PASS, 0, "PASSED", {"FAILED", "ERROR"}, 0, -1},
+    {"official.nes", SCREEN_TEXT, 1200, PASS, 0, "All tests complete", {"Error", "Failed"}, 0, -1},
+    {"nestest.nes", SCREEN_TEXT, 300, PASS, 0, "OK Run all tests", {}, 0, 10}, // results replace OK with a code
+    {"scanline.nes", FRAME_HASH, 120, PASS, 0, nullptr, {}, 0xf7d7f2a99717b4e3ULL, -1},
+    {"scanline2.nes", FRAME_HASH, 120, PASS, 0, nullptr, {}, 0xf7d7f2a99717b4e3ULL, -1},
+    {"scroll.nes", FRAME_HASH, 60, PASS, 0, nullptr, {}, 0x16d438257f4aba05ULL, -1},
+    {"test_ppu_read_buffer.nes", FRAME_HASH, 60, KNOWN_FAIL, 0, nullptr, {}, 0, -1}, // mapper 3
+};
+
+struct Outcome {
+    bool passed = false;
+    std::string detail;
+    int frames = 0;
+    double ms = 0;
+};
+
+// Nametable 0 as text, tile numbers taken as ASCII like the test ROMs' fonts
+static std::string screen_text(Console& console) {
+    std::string text;
+    for (uint16_t addr = 0x2000; addr < 0x23C0; addr++) {
+        uint8_t tile = console.get_cpu().mapper->read_ppu(addr);
+        text += (tile >= 0x20 && tile < 0x7F) ? (char)tile : ' ';
+        if ((addr & 31) == 31) {
+            text += '\n';
+        }
+    }
+    return text;
+}
+
+// The end of blargg's text after $6004 on one line: its last three lines
+// with words in them, which skips progress grids and CRCs
+static std::string blargg_text(const std::vector<uint8_t>& prg_ram) {
+    std::vector<std::string> lines(1);
+    for (size_t i = 4; i < prg_ram.size() && prg_ram[i] != 0; i++) {
+        if (prg_ram[i] == '\n') {
+            lines.emplace_back();
+        }
+        else {
+            lines.back() += (char)prg_ram[i];
+        }
+    }
+    std::string text;
+    int kept = 0;
+    for (size_t i = lines.size(); i-- > 0 && kept < 3;) {
+        bool words = false;
+        for (char c : lines[i]) {
+            words |= (c >= 'a' && c <= 'z');
+        }
+        if (words) {
+            text = text.empty() ? lines[i] : lines[i] + " / " + text;
+            kept++;
+        }
+    }
+    return text;
+}
+
+static void run_test(const RomTest& test, const std::string& dir, Outcome& out) {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Console> console(new Console());
+    if (!console->load_rom(dir + "/" + test.rom)) {
+        out.detail = "can't load";
+        return;
+    }
+    console->get_apu().set_muted(true);
+    std::vector<uint8_t>& prg_ram = console->get_cpu().mapper->prg_ram();
+
+    bool done = false;
+    for (int frame = 0; frame < test.frames && !done; frame++) {
+        bool last = (frame + 1 == test.frames);
+        console->get_ppu().setRenderMode(test.check == FRAME_HASH && last ? RENDER_FULL : RENDER_OFF);
+        bool start_held = test.press_start >= 0 && frame >= test.press_start && frame < test.press_start + 10;
+        console->set_buttons(start_held ? BUTTON_START : 0, 0);
+        console->run_frame();
+        out.frames = frame + 1;
+
+        switch (test.check) {
+        case BLARGG_6000:
+            if (prg_ram.size() >= 4 && prg_ram[1] == 0xDE && prg_ram[2] == 0xB0 && prg_ram[3] == 0x61) {
+                if (prg_ram[0] == 0x81) {
+                    out.detail = "wants a reset, which isn't supported";
+                    done = true;
+                }
+                else if (prg_ram[0] < 0x80) {
+                    out.passed = (prg_ram[0] == 0);
+                    out.detail = blargg_text(prg_ram);
+                    done = true;
+                }
+            }
+            break;
+        case RESULT_BYTE:
+            if (last) {
+                uint8_t code = console->get_cpu().get_ram()[test.address];
+                out.passed = (code == 1);
+                char detail[32];
+                snprintf(detail, sizeof(detail), "result $%02X", code);
+                out.detail = detail;
+            }
+            break;
+        case SCREEN_TEXT: {
+            std::string text = screen_text(*console);
+            for (const char* fail : test.fail) {
+                if (fail && text.find(fail) != std::string::npos) {
+                    out.detail = std::string("screen shows \"") + fail + "\"";
+                    done = true;
+                }
+            }
+            if (!done && text.find(test.text) != std::string::npos) {
+                out.passed = true;
+                done = true;
+            }
+            break;
+        }
+        case FRAME_HASH:
+            if (last) {
+                uint64_t hash = console->frame_hash();
+                out.passed = (hash == test.hash);
+                char detail[48];
+                snprintf(detail, sizeof(detail), "frame hash %016llx", (unsigned long long)hash);
+                out.detail = detail;
+            }
+            break;
+        }
+    }
+    if (!done && out.detail.empty()) {
+        out.detail = "no result";
+    }
+    out.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    // command line: [--threads N] [rom directory]
+    std::string dir = "testing";
+    unsigned threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (unsigned)atoi(argv[++i]);
+        }
+        else {
+            dir = argv[i];
+        }
+    }
+
+    const size_t count = sizeof(TESTS) / sizeof(TESTS[0]);
+    std::vector<Outcome> outcomes(count);
+    auto start = std::chrono::steady_clock::now();
+    {
+        WorkStealingPool pool(threads);
+        for (size_t i = 0; i < count; i++) {
+            pool.submit([&, i] { run_test(TESTS[i], dir, outcomes[i]); });
+        }
+        pool.wait_idle();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int passed = 0, known = 0, fixed = 0, broken = 0;
+    for (size_t i = 0; i < count; i++) {
+        const RomTest& test = TESTS[i];
+        const Outcome& out = outcomes[i];
+        const char* verdict;
+        if (out.passed) {
+            verdict = (test.expect == PASS) ? "pass" : "PASS (was a known failure, update the table)";
+            passed++;
+            fixed += (test.expect == KNOWN_FAIL);
+        }
+        else if (test.expect == KNOWN_FAIL) {
+            verdict = "known failure";
+            known++;
+        }
+        else {
+            verdict = "FAIL";
+            broken++;
+        }
+        printf("%-26s %-14s %5d frames %8.1f ms  %s\n", test.rom, verdict, out.frames, out.ms, out.detail.c_str());
+    }
+    printf("%d passed, %d known failures, %d newly passing, %d failed (%.2f s)\n", passed - fixed, known, fixed,
+           broken, seconds);
+    return broken ? 1 : 0;
+}
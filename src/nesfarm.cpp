@@ -0,0 +1,265 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+#include "console.h"
+#include "movie.h"
+#include "rom.h"
+#include "work_stealing.h"
+
+/*
+ * Headless batch runner: plays a list of jobs (a ROM, optionally an input
+ * movie, a frame count) on every core and writes per job
+ *
+ *   NNN_name.hashes  frame number and frame hash (see Console::frame_hash)
+ *   NNN_name.ram     the CPU's 2KB of RAM, then the cartridge's PRG-RAM
+ *
+ * plus a summary with timings on stdout. Job lengths vary a lot, so they
+ * run on a WorkStealingPool. Consoles are independent, each job has its
+ * own; jobs on the same ROM share its image through a RomCache.
+ *
+ * Job list, one per line, # starts a comment:
+ *   rom.nes [movie.nesm|-] [frames]
+ * With a movie the job starts from its start state and plays its input,
+ * for frames frames if given (no buttons past its end), else its length.
+ * Without one it runs frames frames from power on with no buttons.
+ */
+
+struct Job {
+    std::string rom;
+    std::string movie; // empty for none
+    size_t frames = 0; // 0 = the movie's length
+
+    // results
+    bool ok = false;
+    std::string error;
+    size_t frames_run = 0;
+    double seconds = 0;
+    uint64_t last_hash = 0;
+    uint64_t ram_hash = 0;
+};
+
+static bool read_jobs(const char* path, std::vector<Job>& jobs) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "can't read job list %s\n", path);
+        return false;
+    }
+    char text[4096];
+    int line = 0;
+    bool ok = true;
+    while (fgets(text, sizeof(text), f)) {
+        line++;
+        char* comment = strchr(text, '#');
+        if (comment) {
+            *comment = 0;
+        }
+        std::istringstream fields(text);
+        Job job;
+        std::string movie, frames;
+        if (!(fields >> job.rom)) {
+            continue; // blank
+        }
+        if (fields >> movie && movie != "-") {
+            job.movie = movie;
+        }
+        if (fields >> frames) {
+            char* end;
+            job.frames = strtoul(frames.c_str(), &end, 10);
+            if (*end) {
+                fprintf(stderr, "%s:%d: bad frame count %s\n", path, line, frames.c_str());
+                ok = false;
+            }
+        }
+        if (job.movie.empty() && job.frames == 0) {
+            fprintf(stderr, "%s:%d: a job without a movie needs a frame count\n", path, line);
+            ok = false;
+        }
+        jobs.push_back(job);
+    }
+    fclose(f);
+    return ok;
+}
+
+static uint64_t fnv1a(const uint8_t* data, size_t size) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// name of the ROM file without directory or extension
+static std::string base_name(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return (dot == std::string::npos || dot == 0) ? name : name.substr(0, dot);
+}
+
+static bool write_file(const std::string& path, const std::vector<uint8_t>& data) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok;
+}
+
+// Run one job, the same steps as the emulator's movie playback: buttons,
+// then a frame. Frames that aren't hashed skip drawing.
+static void run_job(Job& job, size_t index, RomCache& roms, const std::string& out_dir, int hash_every) {
+    Movie movie;
+    if (!job.movie.empty()) {
+        if (!movie.load(job.movie)) {
+            job.error = "couldn't read movie " + job.movie;
+            return;
+        }
+        if (movie.rom_hash != rom_file_hash(job.rom.c_str())) {
+            job.error = job.movie + " was recorded with a different ROM";
+            return;
+        }
+    }
+    std::shared_ptr<const RomImage> rom = roms.load(job.rom);
+    std::unique_ptr<Console> console(new Console());
+    if (!rom || !console->load_rom(rom)) {
+        job.error = "couldn't load " + job.rom;
+        return;
+    }
+    if (!job.movie.empty() && !console->load_state(movie.start_state.data(), movie.start_state.size())) {
+        job.error = job.movie + " has a broken start state";
+        return;
+    }
+    size_t frames = job.frames > 0 ? job.frames : movie.length();
+    console->get_apu().set_muted(true);
+
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "%03zu_", index);
+    std::string base = out_dir + "/" + prefix + base_name(job.rom);
+    FILE* hashes = fopen((base + ".hashes").c_str(), "w");
+    if (!hashes) {
+        job.error = "can't write " + base + ".hashes";
+        return;
+    }
+    std::vector<char> hash_buffer(1 << 16);
+    setvbuf(hashes, hash_buffer.data(), _IOFBF, hash_buffer.size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < frames; frame++) {
+        bool hashed = (frame + 1 == frames) || (hash_every > 0 && (frame + 1) % hash_every == 0);
+        console->get_ppu().setRenderMode(hashed ? RENDER_FULL : RENDER_OFF);
+        if (frame < movie.length()) {
+            console->set_buttons(movie.player1(frame), movie.player2(frame));
+        }
+        else {
+            console->set_buttons(0, 0);
+        }
+        console->run_frame();
+        if (hashed) {
+            job.last_hash = console->frame_hash();
+            fprintf(hashes, "%zu %016llx\n", frame + 1, (unsigned long long)job.last_hash);
+        }
+    }
+    job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    job.frames_run = frames;
+    fclose(hashes);
+
+    std::vector<uint8_t> ram(console->get_cpu().get_ram(), console->get_cpu().get_ram() + 0x800);
+    std::vector<uint8_t>& prg_ram = console->get_cpu().mapper->prg_ram();
+    ram.insert(ram.end(), prg_ram.begin(), prg_ram.end());
+    job.ram_hash = fnv1a(ram.data(), ram.size());
+    if (!write_file(base + ".ram", ram)) {
+        job.error = "can't write " + base + ".ram";
+        return;
+    }
+    job.ok = true;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: nesfarm [--threads N] [--out DIR] [--hash-every N] JOBLIST\n"
+                    "  --threads N     workers, default one per core\n"
+                    "  --out DIR       where the .hashes and .ram files go, default farm_out\n"
+                    "  --hash-every N  hash every Nth frame, 0 = only the last, default 1\n");
+}
+
+int main(int argc, char* argv[]) {
+    unsigned threads = 0;
+    std::string out_dir = "farm_out";
+    int hash_every = 1;
+    const char* list_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (unsigned)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--hash-every") == 0 && i + 1 < argc) {
+            hash_every = atoi(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && !list_path) {
+            list_path = argv[i];
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!list_path) {
+        usage();
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    if (!read_jobs(list_path, jobs)) {
+        return 1;
+    }
+    if (mkdir(out_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        perror(out_dir.c_str());
+        return 1;
+    }
+
+    RomCache roms;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t steals;
+    unsigned workers;
+    {
+        WorkStealingPool pool(threads);
+        workers = pool.size();
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&, i] { run_job(jobs[i], i, roms, out_dir, hash_every); });
+        }
+        pool.wait_idle();
+        steals = pool.steals();
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-4s %-28s %8s %9s %9s %-16s %-16s\n", "job", "rom", "frames", "seconds", "fps", "last frame", "ram");
+    int failed = 0;
+    double busy = 0;
+    size_t total_frames = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Job& job = jobs[i];
+        if (!job.ok) {
+            printf("%-4zu %-28s FAILED: %s\n", i, base_name(job.rom).c_str(), job.error.c_str());
+            failed++;
+            continue;
+        }
+        printf("%-4zu %-28s %8zu %9.3f %9.1f %016llx %016llx\n", i, base_name(job.rom).c_str(), job.frames_run,
+               job.seconds, job.seconds > 0 ? job.frames_run / job.seconds : 0.0,
+               (unsigned long long)job.last_hash, (unsigned long long)job.ram_hash);
+        busy += job.seconds;
+        total_frames += job.frames_run;
+    }
+    printf("%zu jobs (%d failed), %zu frames in %.3f s on %u workers (%.1f fps, %.0f%% busy, %llu stolen)\n",
+           jobs.size(), failed, total_frames, wall, workers, wall > 0 ? total_frames / wall : 0.0,
+           wall > 0 ? 100.0 * busy / (wall * workers) : 0.0, (unsigned long long)steals);
+    return failed ? 1 : 0;
+}
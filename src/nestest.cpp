@@ -0,0 +1,179 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "console.h"
+#include "trace.h"
+
+/*
+ * Runs nestest.nes in its automated mode (from $C000, no PPU needed) with
+ * the nestest tracer on, and compares every line with a golden log such as
+ * the well known nestest.log. Stops at the first line that differs and
+ * shows it with the lines before it. Without a golden log it only traces.
+ *
+ * This CPU has no unofficial opcodes, so the run ends where nestest starts
+ * on them. Getting there with no unimplemented opcode on the way and both
+ * official result codes at 0 is a pass; the unofficial half is a known
+ * failure and not checked. Run like this nestest leaves its codes in RAM
+ * rather than in $02/$03 (those are for the menu): the first error of the
+ * first official half goes to $00 and is moved to $10 at $C61D, the
+ * second half's is in $00 when the run ends.
+ */
+
+// where nestest.log starts on the unofficial opcodes (04 A9, line 5004)
+static const uint16_t UNOFFICIAL_START = 0xC6BD;
+
+static bool read_lines(const char* path, std::vector<std::string>& lines) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char text[512];
+    while (fgets(text, sizeof(text), f)) {
+        size_t size = strlen(text);
+        while (size && (text[size - 1] == '\n' || text[size - 1] == '\r')) {
+            size--;
+        }
+        lines.emplace_back(text, size);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    // command line: [--golden nestest.log] [--trace out.log] [--lines N] [rom]
+    const char* rom_path = "testing/nestest.nes";
+    const char* golden_path = nullptr;
+    const char* trace_path = nullptr;
+    uint64_t limit = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            golden_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+            limit = strtoull(argv[++i], nullptr, 10);
+        }
+        else {
+            rom_path = argv[i];
+        }
+    }
+
+    std::vector<std::string> golden;
+    if (golden_path && !read_lines(golden_path, golden)) {
+        fprintf(stderr, "can't read golden log %s\n", golden_path);
+        return 1;
+    }
+    if (limit == 0 && golden_path) {
+        limit = golden.size();
+    }
+
+    std::unique_ptr<Console> console(new Console());
+    if (!console->load_rom(rom_path)) {
+        return 1;
+    }
+    console->get_apu().set_muted(true);
+    console->get_ppu().setRenderMode(RENDER_OFF);
+
+    // the state nestest.log starts in: PC $C000, P $24, 7 cycles (21 dots)
+    // into the frame
+    CPU& cpu = console->get_cpu();
+    cpu.set_PC(0xC000);
+    cpu.set_flag(FLAG_BREAK, false);
+    cpu.get_cycles() = 7;
+    console->get_ppu().run(21);
+
+    FILE* trace_file = nullptr;
+    if (trace_path && !(trace_file = fopen(trace_path, "w"))) {
+        fprintf(stderr, "can't write %s\n", trace_path);
+        return 1;
+    }
+
+    uint64_t line = 0;
+    bool diverged = false;
+    bool finished = false; // got to the unofficial opcodes
+    bool bad_instruction = false;
+    std::string traced_line;
+    std::deque<std::string> context; // the last lines that matched
+    {
+        NestestTracer tracer(trace_file);
+        tracer.on_line = [&](const char* text, size_t size) {
+            if (limit && line >= limit) {
+                return false;
+            }
+            if (line < golden.size() && !same_trace_line(text, size, golden[line].data(), golden[line].size())) {
+                traced_line.assign(text, size);
+                diverged = true;
+                return false;
+            }
+            if (golden_path) {
+                context.emplace_back(text, size);
+                if (context.size() > 4) {
+                    context.pop_front();
+                }
+            }
+            line++;
+            return true;
+        };
+
+        // the tests finish within a couple of frames, the cap is for a
+        // CPU that went astray. The instruction the trace stops on still
+        // runs, so an unimplemented one only counts before that.
+        for (int frame = 0; frame < 600 && !tracer.stopped();) {
+            if (cpu.get_PC() == UNOFFICIAL_START) {
+                finished = true;
+                break;
+            }
+            frame += console->step(tracer);
+            if (cpu.ran_bad_instruction() && !tracer.stopped()) {
+                bad_instruction = true;
+                break;
+            }
+        }
+    }
+    if (trace_file) {
+        fclose(trace_file);
+    }
+
+    const uint8_t* ram = cpu.get_ram();
+    int status = 0;
+    if (diverged) {
+        printf("first difference at line %llu:\n", (unsigned long long)line + 1);
+        for (const std::string& text : context) {
+            printf("  ok      %s\n", text.c_str());
+        }
+        printf("  golden  %s\n", golden[line].c_str());
+        printf("  traced  %s\n", traced_line.c_str());
+        status = 1;
+    }
+    else if (golden_path) {
+        printf("%llu lines match %s\n", (unsigned long long)line, golden_path);
+        if (finished && line < golden.size()) {
+            printf("the other %llu golden lines are the unofficial opcodes\n",
+                   (unsigned long long)(golden.size() - line));
+        }
+    }
+    else {
+        printf("traced %llu lines\n", (unsigned long long)line);
+    }
+
+    if (bad_instruction) {
+        printf("unimplemented opcode before the unofficial opcode tests, at line %llu\n", (unsigned long long)line);
+        status = 1;
+    }
+    else if (!finished && !diverged && !(limit && line >= limit)) {
+        printf("the trace never got to the unofficial opcodes at $%04X\n", UNOFFICIAL_START);
+        status = 1;
+    }
+    printf("nestest result codes, official opcodes: $10=%02X $00=%02X (00 = passed)\n", ram[0x10], ram[0x00]);
+    printf("unofficial opcodes: known failure, not implemented\n");
+    if (ram[0x10] || ram[0x00]) {
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "console.h"
+#include "rollback.h"
+#include "transport.h"
+
+/*
+ * Two rollback netplay sessions talking over a LoopbackTransport pair with
+ * latency, jitter and packet loss, both in this process and run on one
+ * thread. Each plays its own scripted controller. When the scripts are done
+ * both sides have to end on exactly the machine an offline console reaches
+ * with the same buttons on the same frames (frame hash and save state).
+ * The deepest rollback (restore plus re-simulation) also has to fit the
+ * frame time budget.
+ *
+ *   netplay_tests [--frames N] [--latency MS] [--jitter MS] [--loss PERCENT]
+ *                 [--frame-ms MS] [--budget MS] [rom]
+ *
+ * Frames run faster than 60 Hz (--frame-ms) so the test is quick; the
+ * defaults are about 5 to 9 frames of latency, so rollbacks go the full
+ * MAX_ROLLBACK frames deep. Exits 1 if anything doesn't hold.
+ */
+
+static const int INPUT_DELAY = 1;
+static const int TAIL = 40; // idle frames at the end, long enough for every input to arrive
+
+// Player 1 starts the game and runs right, jumping now and then; player 2
+// changes buttons every few frames. Nobody presses anything during the
+// input delay at the start and in the tail.
+static uint8_t script(int player, int frame, int frames) {
+    if (frame < INPUT_DELAY || frame >= frames - TAIL) {
+        return 0;
+    }
+    if (player == 0) {
+        if (frame < 40) {
+            return 0;
+        }
+        if (frame < 46) {
+            return BUTTON_START;
+        }
+        return BUTTON_RIGHT | BUTTON_B | ((frame / 20) % 3 == 0 ? BUTTON_A : 0);
+    }
+    uint32_t x = (uint32_t)(frame / 7) * 2654435761u;
+    return (uint8_t)(x >> 24);
+}
+
+int main(int argc, char* argv[]) {
+    const char* rom_path = "testing/Super_mario_brothers.nes";
+    int frames = 400;
+    double latency_ms = 25;
+    double jitter_ms = 20;
+    int loss_percent = 10;
+    double frame_ms = 5;
+    double budget_ms = 16;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            latency_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc) {
+            jitter_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            loss_percent = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--frame-ms") == 0 && i + 1 < argc) {
+            frame_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget_ms = atof(argv[++i]);
+        }
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: netplay_tests [--frames N] [--latency MS] [--jitter MS] [--loss PERCENT]\n"
+                            "                     [--frame-ms MS] [--budget MS] [rom]\n");
+            return 2;
+        }
+        else {
+            rom_path = argv[i];
+        }
+    }
+    if (frames <= TAIL) {
+        frames = TAIL + 1;
+    }
+
+    // the offline run everything is checked against
+    std::unique_ptr<Console> offline(new Console());
+    if (!offline->load_rom(rom_path)) {
+        return 2;
+    }
+    offline->get_apu().set_muted(true);
+    for (int frame = 0; frame < frames; frame++) {
+        offline->set_buttons(script(0, frame, frames), script(1, frame, frames));
+        offline->run_frame();
+    }
+
+    std::unique_ptr<LoopbackTransport> links[2];
+    LoopbackTransport::create_pair(links[0], links[1], latency_ms, jitter_ms, loss_percent);
+    std::unique_ptr<Console> consoles[2];
+    std::unique_ptr<RollbackSession> sessions[2];
+    for (int side = 0; side < 2; side++) {
+        consoles[side].reset(new Console());
+        if (!consoles[side]->load_rom(rom_path)) {
+            return 2;
+        }
+        consoles[side]->get_apu().set_muted(true);
+        sessions[side].reset(new RollbackSession(*links[side], side, *consoles[side], RENDER_FULL, INPUT_DELAY));
+    }
+
+    // Each side runs a frame whenever its next one is due, a stalled side
+    // tries again on the next pass. A side's local input for a call is the
+    // one for the frame it lands on, input_delay frames ahead.
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(frame_ms));
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point due[2] = {start, start};
+    while (sessions[0]->frame() < (uint32_t)frames || sessions[1]->frame() < (uint32_t)frames) {
+        auto now = std::chrono::steady_clock::now();
+        for (int side = 0; side < 2; side++) {
+            RollbackSession& session = *sessions[side];
+            if (session.frame() >= (uint32_t)frames || now < due[side]) {
+                continue;
+            }
+            if (session.advance_frame(script(side, (int)session.frame() + INPUT_DELAY, frames))) {
+                due[side] += period;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint8_t> expected, state;
+    offline->save_state(expected);
+    uint64_t expected_hash = offline->frame_hash();
+    double worst_ms = 0;
+    int failed = 0;
+    for (int side = 0; side < 2; side++) {
+        printf("player %d ", side + 1);
+        sessions[side]->print_stats();
+        NetplayStats stats = sessions[side]->get_stats();
+        if (stats.max_rollback_ms > worst_ms) {
+            worst_ms = stats.max_rollback_ms;
+        }
+
+        consoles[side]->save_state(state);
+        uint64_t hash = consoles[side]->frame_hash();
+        if (hash != expected_hash || state != expected) {
+            printf("player %d ended on frame %016llx, the offline run on %016llx%s\n", side + 1,
+                   (unsigned long long)hash, (unsigned long long)expected_hash,
+                   state != expected ? " (states differ)" : "");
+            failed++;
+        }
+    }
+    if (!failed) {
+        printf("both sides match the offline run after %d frames (%.2f s)\n", frames, seconds);
+    }
+    printf("worst rollback %.3f ms, budget %.1f ms\n", worst_ms, budget_ms);
+    if (worst_ms > budget_ms) {
+        printf("rollback over budget\n");
+        failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+#include "pacer.h"
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+// how many whole periods we may fall behind before giving up on catching up
+static constexpr int MAX_FRAMES_BEHIND = 3;
+
+// audio rate control gains, on the fill error as a fraction of the target
+static constexpr double PROPORTIONAL_GAIN = 1.0;
+static constexpr double INTEGRAL_GAIN = 0.005;
+
+FramePacer::FramePacer(double hz)
+    : spin_margin(std::chrono::microseconds(1500)), vsync(false) {
+    set_rate(hz);
+    reset();
+}
+
+void FramePacer::set_rate(double hz) {
+    period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / hz));
+}
+
+double FramePacer::get_rate() const {
+    return 1.0 / std::chrono::duration<double>(period).count();
+}
+
+void FramePacer::set_vsync(bool enabled) {
+    vsync = enabled;
+}
+
+bool FramePacer::get_vsync() const {
+    return vsync;
+}
+
+void FramePacer::set_spin_margin(std::chrono::microseconds margin) {
+    spin_margin = margin;
+}
+
+void FramePacer::reset() {
+    started = false;
+    count = 0;
+    mean = 0;
+    m2 = 0;
+    min_ms = 0;
+    max_ms = 0;
+    abs_dev_sum = 0;
+    late = 0;
+    resyncs = 0;
+}
+
+void FramePacer::resync() {
+    started = false;
+}
+
+void FramePacer::wait() {
+    clock::time_point now = clock::now();
+
+    // first frame just starts the schedule
+    if (!started) {
+        started = true;
+        deadline = now + period;
+        last_frame = now;
+        return;
+    }
+
+    if (!vsync) {
+        if (now < deadline) {
+            // sleep most of the way, the OS scheduler is only good to ~1 ms
+            clock::duration remaining = deadline - now;
+            if (remaining > spin_margin) {
+                std::this_thread::sleep_for(remaining - spin_margin);
+            }
+            // spin the rest
+            while ((now = clock::now()) < deadline) {
+                std::this_thread::yield();
+            }
+        }
+        else {
+            late++;
+        }
+
+        // advance by exactly one period so overshoot doesn't accumulate
+        deadline += period;
+        if (now - deadline > period * MAX_FRAMES_BEHIND) {
+            deadline = now + period;
+            resyncs++;
+        }
+    }
+
+    record(now);
+}
+
+void FramePacer::record(clock::time_point now) {
+    double ms = std::chrono::duration<double, std::milli>(now - last_frame).count();
+    double target = std::chrono::duration<double, std::milli>(period).count();
+    last_frame = now;
+
+    count++;
+    double delta = ms - mean;
+    mean += delta / count;
+    m2 += delta * (ms - mean);
+    if (count == 1 || ms < min_ms) min_ms = ms;
+    if (count == 1 || ms > max_ms) max_ms = ms;
+    abs_dev_sum += std::fabs(ms - target);
+}
+
+PacerStats FramePacer::get_stats() const {
+    PacerStats s;
+    s.frames = count;
+    s.target_ms = std::chrono::duration<double, std::milli>(period).count();
+    s.mean_ms = mean;
+    s.stddev_ms = (count > 1) ? std::sqrt(m2 / (count - 1)) : 0.0;
+    s.min_ms = min_ms;
+    s.max_ms = max_ms;
+    s.jitter_ms = count ? abs_dev_sum / count : 0.0;
+    s.late = late;
+    s.resyncs = resyncs;
+    return s;
+}
+
+void FramePacer::print_stats() const {
+    PacerStats s = get_stats();
+    printf("Frame pacing: %llu frames, target %.3f ms (%.4f Hz)%s\n",
+           (unsigned long long)s.frames, s.target_ms, get_rate(), vsync ? " [vsync]" : "");
+    printf("  mean %.3f ms  stddev %.3f ms  min %.3f ms  max %.3f ms  jitter %.3f ms\n",
+           s.mean_ms, s.stddev_ms, s.min_ms, s.max_ms, s.jitter_ms);
+    printf("  late frames %llu  resyncs %llu\n", (unsigned long long)s.late, (unsigned long long)s.resyncs);
+}
+
+AudioRateControl::AudioRateControl(const AudioRing& ring_ref)
+    : ring(ring_ref), max_delta(0.005), target(0), samples_per_ms(0), integral(0) {
+    reset();
+}
+
+void AudioRateControl::set_target(double ms, int sample_rate) {
+    samples_per_ms = sample_rate / 1000.0;
+    target = ms * samples_per_ms;
+}
+
+size_t AudioRateControl::target_samples() const {
+    return (size_t)target;
+}
+
+void AudioRateControl::set_max_delta(double delta) {
+    max_delta = delta;
+}
+
+double AudioRateControl::update() {
+    double fill = (double)ring.size();
+    double ratio = 1.0;
+    if (target > 0) {
+        double error = (fill - target) / target;
+        if (error > 1.0) error = 1.0;
+        if (error < -1.0) error = -1.0;
+
+        // The proportional part alone would settle off target by the clock
+        // mismatch over max_delta, a slow integral takes that offset out.
+        // The fill is only sampled once a frame and jumps by a device
+        // buffer at a time, so both terms stay gentle.
+        integral += error * INTEGRAL_GAIN;
+        if (integral > 1.0) integral = 1.0;
+        if (integral < -1.0) integral = -1.0;
+
+        double control = error * PROPORTIONAL_GAIN + integral;
+        if (control > 1.0) control = 1.0;
+        if (control < -1.0) control = -1.0;
+        ratio = 1.0 - max_delta * control;
+    }
+
+    count++;
+    fill_sum += fill;
+    if (count == 1 || fill < min_fill) min_fill = fill;
+    if (count == 1 || fill > max_fill) max_fill = fill;
+    if (count == 1 || ratio < min_ratio) min_ratio = ratio;
+    if (count == 1 || ratio > max_ratio) max_ratio = ratio;
+    return ratio;
+}
+
+void AudioRateControl::reset() {
+    integral = 0;
+    count = 0;
+    fill_sum = 0;
+    min_fill = 0;
+    max_fill = 0;
+    min_ratio = 1;
+    max_ratio = 1;
+}
+
+AudioStats AudioRateControl::get_stats() const {
+    AudioStats s;
+    double ms = (samples_per_ms > 0) ? 1.0 / samples_per_ms : 0.0;
+    s.frames = count;
+    s.target_ms = target * ms;
+    s.mean_fill_ms = count ? fill_sum / count * ms : 0.0;
+    s.min_fill_ms = min_fill * ms;
+    s.max_fill_ms = max_fill * ms;
+    s.min_ratio = min_ratio;
+    s.max_ratio = max_ratio;
+    s.underruns = ring.underruns();
+    s.dropped = ring.dropped();
+    return s;
+}
+
+void AudioRateControl::print_stats() const {
+    AudioStats s = get_stats();
+    printf("Audio buffer: %llu frames, target %.1f ms\n", (unsigned long long)s.frames, s.target_ms);
+    printf("  fill mean %.1f ms  min %.1f ms  max %.1f ms  rate ratio %.4f-%.4f\n",
+           s.mean_fill_ms, s.min_fill_ms, s.max_fill_ms, s.min_ratio, s.max_ratio);
+    printf("  underruns %llu  dropped samples %llu\n", (unsigned long long)s.underruns, (unsigned long long)s.dropped);
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include "audio_ring.h"
+
+// NTSC timing: the PPU runs 341 * 262 dots per frame (one dot shorter on odd
+// frames when rendering), at 3 dots per CPU cycle.
+static constexpr double NES_CPU_CLOCK_HZ = 1789773.0;
+static constexpr double NES_FRAME_HZ = (NES_CPU_CLOCK_HZ * 3.0) / (341.0 * 262.0 - 0.5); // ~60.0988 Hz
+
+// Frame-time statistics collected by the pacer (all times in milliseconds)
+struct PacerStats {
+    uint64_t frames = 0;     // frames measured
+    double target_ms = 0;    // ideal frame period
+    double mean_ms = 0;      // mean frame-to-frame time
+    double stddev_ms = 0;    // standard deviation of frame-to-frame time
+    double min_ms = 0;       // shortest frame
+    double max_ms = 0;       // longest frame
+    double jitter_ms = 0;    // mean absolute deviation from target_ms
+    uint64_t late = 0;       // frames where the deadline was already missed
+    uint64_t resyncs = 0;    // times the schedule was dropped and restarted
+};
+
+// Audio ring fill statistics, sampled once per frame right after the frame's
+// samples are queued (times in milliseconds of audio)
+struct AudioStats {
+    uint64_t frames = 0;     // frames measured
+    double target_ms = 0;    // fill the controller aims for
+    double mean_fill_ms = 0;
+    double min_fill_ms = 0;
+    double max_fill_ms = 0;
+    double min_ratio = 1;    // range of the rate adjustment applied
+    double max_ratio = 1;
+    uint64_t underruns = 0;  // audio callbacks that found the ring short
+    uint64_t dropped = 0;    // samples discarded because the ring was full
+};
+
+/*
+ * Paces the main loop to the emulated frame rate.
+ *
+ * Deadlines are absolute points on std::chrono::steady_clock, advanced by
+ * exactly one period per frame, so sleep overshoot on one frame is paid back
+ * on the next instead of accumulating as drift. Waiting is a coarse sleep
+ * followed by a short spin to hit the deadline precisely. If we fall more
+ * than a few frames behind (debugger, window drag) the schedule restarts
+ * from "now" instead of running fast to catch up.
+ *
+ * In vsync mode the present call blocks on the display, so wait() only
+ * records statistics.
+ */
+class FramePacer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit FramePacer(double hz = NES_FRAME_HZ);
+
+    void set_rate(double hz);
+    double get_rate() const;
+    void set_vsync(bool enabled);
+    bool get_vsync() const;
+    void set_spin_margin(std::chrono::microseconds margin);
+
+    // restart the schedule and clear statistics
+    void reset();
+
+    // restart the schedule from now but keep statistics (e.g. leaving fast-forward)
+    void resync();
+
+    // block until the current frame's deadline, then schedule the next one
+    void wait();
+
+    PacerStats get_stats() const;
+    void print_stats() const;
+
+private:
+    void record(clock::time_point now);
+
+    clock::duration period;
+    clock::duration spin_margin;
+    clock::time_point deadline;
+    clock::time_point last_frame;
+    bool started;
+    bool vsync;
+
+    // Welford running mean/variance of frame times
+    uint64_t count;
+    double mean;
+    double m2;
+    double min_ms;
+    double max_ms;
+    double abs_dev_sum;
+    uint64_t late;
+    uint64_t resyncs;
+};
+
+/*
+ * Dynamic rate control for audio.
+ *
+ * Video is paced by FramePacer (or vsync), the audio device drains the ring
+ * at its own clock, and the two never agree exactly. Instead of letting the
+ * ring run dry or grow, the APU's output rate is nudged every frame in
+ * proportion to how far the fill level is from the target: a fuller ring
+ * makes the next frame produce slightly fewer samples. Within +/-0.5% the
+ * pitch change is inaudible, and it covers both clock drift and displays
+ * running a bit off 60.0988 Hz.
+ */
+class AudioRateControl {
+public:
+    explicit AudioRateControl(const AudioRing& ring);
+
+    // fill level to hold right after each frame's samples are queued
+    void set_target(double ms, int sample_rate);
+    size_t target_samples() const;
+    void set_max_delta(double delta); // largest ratio adjustment, default 0.005
+
+    // Call once per frame after queuing samples, returns the ratio to
+    // scale the output rate by for the next frame
+    double update();
+
+    void reset();
+    AudioStats get_stats() const;
+    void print_stats() const;
+
+private:
+    const AudioRing& ring;
+    double max_delta;
+    double target;          // samples
+    double samples_per_ms;
+    double integral;
+
+    uint64_t count;
+    double fill_sum;
+    double min_fill;
+    double max_fill;
+    double min_ratio;
+    double max_ratio;
+};
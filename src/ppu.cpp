@@ -1,6 +1,14 @@
+#include <algorithm>
 #include "ppu.h"
 #include "cpu.h"
 #include "input.h"
+#include "bgcache.h"
+#include "deferred.h"
+#include "gray.h"
+#include "savestate.h"
+
+// lines per batch handed to the deferred render workers (240 / 16 batches)
+static constexpr int DEFERRED_CHUNK = 16;
 
 /* Pixel processing unit (PPU) which runs independently of the CPU, 
 but still time-bound to the same timer and the APU */
@@ -8,6 +16,12 @@ but still time-bound to the same timer and the APU */
 PPU::PPU() {
   NMI = false;
   frame_toggle = false;
+  frame_count = 0;
+  render_mode = RENDER_FULL;
+  next_render_mode = RENDER_FULL;
+  bg_line_valid = false;
+  vram_changed = true;
+  snapshot_map_version = 0;
   ppu_cycles = 0;
   scanline = 0;
 
@@ -24,8 +38,6 @@ PPU::PPU() {
   mapper = nullptr;
   
 
-  memset(pattern_table, 0, sizeof(pattern_table));
-  memset(name_tables,    0, sizeof(name_tables));
   memset(palette_RAM,    0, sizeof(palette_RAM));
   memset(OAM,            0, sizeof(OAM));
 
@@ -49,8 +61,20 @@ void PPU::connectMapper(Mapper* mapper_ptr) {
   mapper = mapper_ptr;
 }
 
+PPU::~PPU() = default;
+
 void PPU::write_register(uint16_t cpu_addr, uint8_t value) {
-  switch (cpu_addr % 8) {
+  // Anything that can move the scroll, switch the pattern table or touch VRAM
+  // mid-line sends the rest of the line back to normal fetches
+  uint8_t reg = cpu_addr % 8;
+  if (reg <= 1 || reg >= 5) {
+    bg_line_valid = false;
+  }
+  if (reg == 4 || reg == 7) {
+    vram_changed = true; // OAM or VRAM/palette contents
+  }
+
+  switch (reg) {
     case 0: // $2000 - PPUCTRL
       control = value;
       temp_vram = (temp_vram & 0xF3FF) | ((value & 0x03) << 10);
@@ -106,9 +130,15 @@ void PPU::write_register(uint16_t cpu_addr, uint8_t value) {
       uint16_t addr = vram_addr & 0x3FFF;
       if (addr < 0x2000) {
         mapper->write_ppu(addr, value);
+        if (bg_cache) {
+          bg_cache->invalidate_all(); // CHR-RAM tile changed
+        }
       } 
       else if (addr < 0x3F00) {
         mapper->write_ppu(addr, value);
+        if (bg_cache) {
+          bg_cache->nametable_written(addr);
+        }
       } 
       else {
         uint16_t pal = (addr - 0x3F00) & 0x1F;
@@ -121,6 +151,11 @@ void PPU::write_register(uint16_t cpu_addr, uint8_t value) {
       vram_addr += (control & 0x04) ? 32 : 1;
       break;
   }
+
+  // mid-line change in a deferred frame, the rest of the line uses the new state
+  if (render_mode == RENDER_DEFERRED && scanline < 240 && ppu_cycles >= 1 && ppu_cycles <= 255) {
+    log_segment(ppu_cycles);
+  }
 }
 
 
@@ -166,6 +201,10 @@ uint8_t PPU::read_register(uint16_t cpu_addr) {
 void PPU::oam_write(uint8_t byte) {
   OAM[oam_addr] = byte;
   oam_addr = (oam_addr + 1) & 0xFF;
+  vram_changed = true;
+  if (render_mode == RENDER_DEFERRED && scanline < 240 && ppu_cycles >= 1 && ppu_cycles <= 255) {
+    log_segment(ppu_cycles);
+  }
 }
 
 // increment horizontal scroll in Vram address
@@ -212,9 +251,13 @@ void PPU::copyY() {
 void PPU::tick() {
   ppu_cycles++;
 
-  // VBL start
+  // VBL start, the picture for this frame is complete
   if (scanline == 241 && ppu_cycles == 1) {
+    frame_count++;
     status |= PPUSTATUS_VBLANK;
+    if (render_mode == RENDER_DEFERRED) {
+      deferred->submit(240 - DEFERRED_CHUNK, 240); // last lines of the frame
+    }
     if (control & PPUCTRL_NMI) NMI = true;
   }
 
@@ -224,6 +267,18 @@ void PPU::tick() {
     status &= ~PPUSTATUS_SPRITE0;
     status &= ~PPUSTATUS_OVERFLOW;
     NMI = false;
+
+    // start of a new frame, pick up the requested render mode
+    render_mode = next_render_mode;
+    if (deferred) {
+      deferred->finish(); // workers may still be on the last frame's lines
+    }
+    if (render_mode == RENDER_DEFERRED && !deferred) {
+      render_mode = RENDER_FULL;
+    }
+    if (render_mode == RENDER_GRAY && !gray) {
+      render_mode = RENDER_FULL;
+    }
   }
 
   // Drawing pixel before scroll
@@ -245,6 +300,7 @@ void PPU::tick() {
       }
       if (ppu_cycles == 257) {
         copyX();
+        evaluate_sprites();
         }
       } 
     else if (scanline == 261) {
@@ -276,24 +332,301 @@ void PPU::tick() {
   }
 }
 
+// Positions (scanline * 341 + dot) where idle stretches have to stop so the
+// next tick() lands on an event: VBL set at 241/1, prerender clear at 261/1,
+// and the last prerender dot where the odd-frame skip and frame wrap happen.
+static constexpr uint32_t DOTS_PER_LINE = 341;
+static constexpr uint32_t IDLE_STOPS[] = {
+  241 * DOTS_PER_LINE,
+  261 * DOTS_PER_LINE,
+  261 * DOTS_PER_LINE + 340
+};
+
+// Advance the PPU by a number of dots. While nothing the CPU can see changes
+// per dot (post-render and vblank lines, or rendering disabled in PPUMASK),
+// we jump straight to the next event instead of ticking each dot.
+void PPU::run(uint32_t dots) {
+  while (dots > 0) {
+    bool rendering = ((mask & 0x18) != 0);
+    bool idle = idle_skip && (!rendering || (scanline >= 240 && scanline <= 260));
+
+    if (idle) {
+      uint32_t pos = scanline * DOTS_PER_LINE + ppu_cycles;
+      uint32_t stop = pos;
+      for (uint32_t s : IDLE_STOPS) {
+        if (s >= pos) {
+          stop = s;
+          break;
+        }
+      }
 
-void PPU::render() {
-  // draw visible area pixels
-  if ((scanline >= 240) || (ppu_cycles < 1) || (ppu_cycles > 256)) {
+      if (stop > pos) {
+        uint32_t n = std::min(stop - pos, dots);
+        skip_idle(pos, n);
+        dots -= n;
+        continue;
+      }
+    }
+
+    tick();
+    dots--;
+  }
+}
+
+// Jump n idle dots forward from pos. Never crosses an IDLE_STOPS entry, so
+// there are no events or line wraps to handle, only the backdrop color that
+// visible dots get when rendering is off.
+void PPU::skip_idle(uint32_t pos, uint32_t n) {
+  uint32_t last = pos + n;
+
+  if ((render_mode == RENDER_FULL || render_mode == RENDER_GRAY) && pos < 240 * DOTS_PER_LINE) {
+    uint32_t backdrop = nesColor(palette_RAM[0] & 0x3F);
+    for (uint32_t line = pos / DOTS_PER_LINE; line < 240 && line <= last / DOTS_PER_LINE; ++line) {
+      uint32_t line_start = line * DOTS_PER_LINE;
+      uint32_t from = std::max<uint32_t>(pos + 1, line_start + 1) - line_start;
+      uint32_t to = std::min<uint32_t>(last, line_start + 256) - line_start;
+      if (render_mode == RENDER_GRAY) {
+        if (from <= to) {
+          memset(gray->line + from - 1, gray->luma(palette_RAM[0]), to - from + 1);
+          if (to == 256) {
+            gray->end_line(line);
+          }
+        }
+        continue;
+      }
+      for (uint32_t dot = from; dot <= to; ++dot) {
+        framebuffer[line * 256 + dot - 1] = backdrop;
+      }
+    }
+  }
+
+  // deferred frames still need the register state at the start of each line
+  if (render_mode == RENDER_DEFERRED) {
+    for (uint32_t line = pos / DOTS_PER_LINE; line < 240 && line <= last / DOTS_PER_LINE; ++line) {
+      uint32_t line_start = line * DOTS_PER_LINE + 1;
+      if (line_start > pos && line_start <= last) {
+        scanline = line;
+        ppu_cycles = 1;
+        begin_line();
+      }
+    }
+  }
+
+  scanline = last / DOTS_PER_LINE;
+  ppu_cycles = last % DOTS_PER_LINE;
+}
+
+
+// Turn the nametable pre-render cache on or off
+void PPU::enableBackgroundCache(bool enable) {
+  if (enable && !bg_cache) {
+    bg_cache.reset(new BackgroundCache());
+  }
+  else if (!enable) {
+    bg_cache.reset();
+  }
+  bg_line_valid = false;
+}
+
+// Render RENDER_DEFERRED frames on this many worker threads, 0 turns it off
+void PPU::enableDeferredRender(unsigned threads) {
+  deferred.reset();
+  if (threads > 0) {
+    deferred.reset(new DeferredRenderer(threads, framebuffer));
+  }
+}
+
+// Draw RENDER_GRAY frames at 1/scale size, 0 turns it off
+void PPU::enableGrayOutput(int scale, bool max_pool) {
+  gray.reset();
+  if (scale > 0) {
+    gray.reset(new GrayOutput(scale, max_pool));
+  }
+}
+
+const uint8_t* PPU::grayFrame() {
+  return gray ? gray->frame() : nullptr;
+}
+
+int PPU::grayWidth() {
+  return gray ? gray->width() : 0;
+}
+
+int PPU::grayHeight() {
+  return gray ? gray->height() : 0;
+}
+
+// Wait until the framebuffer holds every line of the last deferred frame
+void PPU::finishRender() {
+  if (deferred) {
+    deferred->finish();
+  }
+}
+
+void PPU::save_state(StateWriter& w) const {
+  w.begin_chunk(state_tag("PPU "), 1);
+  w.put(control);
+  w.put(mask);
+  w.put(status);
+  w.put(oam_addr);
+  w.put(buffer);
+  w.put(ppu_cycles);
+  w.put(scanline);
+  w.put(frame_toggle);
+  w.put(frame_count);
+  w.put(NMI);
+  w.put(vram_addr);
+  w.put(temp_vram);
+  w.put(x);
+  w.put(write_latch);
+  w.write(palette_RAM, sizeof(palette_RAM));
+  w.write(OAM, sizeof(OAM));
+  w.end_chunk();
+}
+
+bool PPU::load_state(StateReader& r) {
+  uint16_t version;
+  if (!r.open_chunk(state_tag("PPU "), version) || version != 1) {
+    return false;
+  }
+  finishRender();
+  r.get(control);
+  r.get(mask);
+  r.get(status);
+  r.get(oam_addr);
+  r.get(buffer);
+  r.get(ppu_cycles);
+  r.get(scanline);
+  r.get(frame_toggle);
+  r.get(frame_count);
+  r.get(NMI);
+  r.get(vram_addr);
+  r.get(temp_vram);
+  r.get(x);
+  r.get(write_latch);
+  r.read(palette_RAM, sizeof(palette_RAM));
+  r.read(OAM, sizeof(OAM));
+
+  // everything derived from VRAM has to be rebuilt
+  bg_line_valid = false;
+  vram_changed = true;
+  if (bg_cache) {
+    bg_cache->invalidate_all();
+  }
+  if (gray) {
+    gray->clear_history(); // a different timeline, don't pool with its frame
+  }
+  return r.ok();
+}
+
+void PPU::copy_state_from(const PPU& other) {
+  finishRender();
+  control = other.control;
+  mask = other.mask;
+  status = other.status;
+  oam_addr = other.oam_addr;
+  buffer = other.buffer;
+  ppu_cycles = other.ppu_cycles;
+  scanline = other.scanline;
+  frame_toggle = other.frame_toggle;
+  frame_count = other.frame_count;
+  NMI = other.NMI;
+  vram_addr = other.vram_addr;
+  temp_vram = other.temp_vram;
+  x = other.x;
+  write_latch = other.write_latch;
+  memcpy(palette_RAM, other.palette_RAM, sizeof(palette_RAM));
+  memcpy(OAM, other.OAM, sizeof(OAM));
+
+  bg_line_valid = false;
+  vram_changed = true;
+  if (bg_cache) {
+    bg_cache->invalidate_all();
+  }
+  if (gray) {
+    gray->clear_history();
+  }
+}
+
+// Log the register state from dot xdot of the current line onwards for the
+// deferred renderer. VRAM, palette and OAM are only copied again if they
+// changed since the last snapshot.
+void PPU::log_segment(int xdot) {
+  if (vram_changed || !vram_snapshot || mapper->ppu_map_version() != snapshot_map_version) {
+    std::shared_ptr<VramSnapshot> snapshot = std::make_shared<VramSnapshot>();
+    for (uint16_t addr = 0; addr < 0x2000; addr++) {
+      snapshot->chr[addr] = mapper->read_ppu(addr);
+    }
+    for (uint16_t addr = 0; addr < 0x1000; addr++) {
+      snapshot->nametables[addr] = mapper->read_ppu(0x2000 + addr);
+    }
+    memcpy(snapshot->palette, palette_RAM, sizeof(palette_RAM));
+    memcpy(snapshot->oam, OAM, sizeof(OAM));
+
+    vram_snapshot = snapshot;
+    vram_changed = false;
+    snapshot_map_version = mapper->ppu_map_version();
+  }
+
+  LineSegment segment;
+  segment.first_dot = xdot;
+  segment.vram_addr = vram_addr;
+  segment.x = x;
+  segment.control = control;
+  segment.mask = mask;
+  segment.vram = vram_snapshot;
+  deferred->add_segment(scanline, segment);
+}
+
+// Start of a visible line. With the background cache on, the whole line of
+// background pixels is copied out of the cache here and the per-dot fetches
+// are skipped, until a register write mid-line sends us back to them.
+void PPU::begin_line() {
+  bg_line_valid = false;
+
+  // deferred frame: log the line's starting state and hand every finished
+  // group of lines to the workers
+  if (render_mode == RENDER_DEFERRED) {
+    log_segment(0);
+    if (scanline > 0 && (scanline % DEFERRED_CHUNK) == 0) {
+      deferred->submit(scanline - DEFERRED_CHUNK, scanline);
+    }
     return;
   }
 
-  int y = scanline;
-   
-  bool sprEnabled = (mask & 0x10) != 0; // show sprites
-  bool sprLeft  = (mask & 0x04) != 0; // show sprites in leftmost 8 px
+  if (!bg_cache || (render_mode != RENDER_FULL && render_mode != RENDER_GRAY)) {
+    return;
+  }
 
-  bool visibleDot = (scanline < 240) && (ppu_cycles >= 1 && ppu_cycles <= 256);
-  int  xdot = ppu_cycles - 1;
+  // coarse Y 30/31 reads attributes in a way the cache doesn't model
+  uint8_t coarseY = ((vram_addr >> 5) & 0x1F);
+  if (coarseY >= 30) {
+    return;
+  }
 
-  bool bgEnabled = (mask & 0x08) != 0; // check ppu mask to see if background is enabled
-  bool bgLeft = (mask & 0x02) != 0; // check if background in leftmost 8 px is enabled
-  bool inLeft8 = (xdot < 8);
+  uint8_t name_table_XBit = ((vram_addr >> 10) & 1);
+  uint8_t name_table_YBit = ((vram_addr >> 11) & 1);
+  uint8_t fineY = ((vram_addr >> 12) & 7);
+
+  // pixel (0, 0) of this line in the 512x480 map of all four nametables
+  int map_x = name_table_XBit * 256 + (vram_addr & 0x1F) * 8 + x;
+  int map_y = name_table_YBit * 240 + coarseY * 8 + fineY;
+
+  bg_line_version = mapper->ppu_map_version();
+  bg_cache->sync((control & 0x10) ? 0x1000 : 0x0000, bg_line_version);
+  bg_cache->read_line(mapper, map_x, map_y, bg_line);
+  bg_line_valid = true;
+}
+
+// Background pixel for the dot at xdot on the current scanline, sampled from vram_addr.
+// Returns the 2-bit color index and stores the attribute palette in palette_high_bits.
+uint8_t PPU::background_pixel(int xdot, uint8_t& palette_high_bits) {
+  // line already pre-rendered from the cache (and no bank switch since)
+  if (bg_line_valid && mapper->ppu_map_version() == bg_line_version) {
+    uint8_t cached = bg_line[xdot];
+    palette_high_bits = cached >> 2;
+    return cached & 0x03;
+  }
 
   // Decoding vram for every dot
   uint8_t coarseY =  ((vram_addr >> 5)  & 0x1F); // Y tile_index coord
@@ -338,7 +671,161 @@ void PPU::render() {
 
   // getting amount to shift attr_byte and finding which color pallete background tile_index is
   int shift = (((coarseY % 4) / 2) * 2 + ((localCoarseX % 4) / 2)) * 2;
-  uint8_t palette_high_bits = (attr_byte >> shift) & 0x03;
+  palette_high_bits = (attr_byte >> shift) & 0x03;
+
+  return color_index;
+}
+
+// Color index (0-3) of OAM sprite i at screen position (xdot, y).
+// The caller has already checked that the position is inside the sprite.
+uint8_t PPU::sprite_pixel(int i, int xdot, int y) {
+  bool spriteMode8x16 = (control & 0x20) != 0; // check if current sprite size is 8x8 or 8x16
+
+  uint8_t tile_index = OAM[i*4 + 1];
+  uint8_t attr = OAM[i*4 + 2];
+  uint8_t sprite_x = OAM[i*4 + 3];
+  int sprite_y = (int)OAM[i*4 + 0] + 1; // Idk saw this on forum: Y is top-1
+
+  // calcualte the pixel in the sprite
+  int col = xdot - sprite_x;
+  int row = y - sprite_y;
+  int px  = (attr & 0x40) ? (7 - col) : col; // horizontal flip
+
+  // Finding the pattern table address for sprite
+  uint16_t pattern_addr;
+
+  if (spriteMode8x16) {
+    uint16_t spr_base = (tile_index & 1) ? 0x1000 : 0x0000;
+    bool vertical_flip = (attr & 0x80) != 0;
+    bool topHalf;
+    uint8_t fineY;
+
+    // getting y pixel and top half based on if vertically flipped
+    if (!vertical_flip) { 
+      topHalf = (row < 8);
+      fineY = row & 7;
+    }
+    else {
+      topHalf = (row >= 8);
+      fineY = 7 - (row & 7);
+    }
+
+    uint8_t  tileIndex = (tile_index & 0xFE) + (topHalf ? 0 : 1);
+    pattern_addr = spr_base + tileIndex * 16 + fineY;
+  } 
+  else { // if in 8x8 mode, then use same pattern table base in PPUCTRL bit 3
+    uint16_t spr_base = (control & 0x08) ? 0x1000 : 0x0000;
+    int fineY = (attr & 0x80) ? (7 - (row & 7)) : (row & 7);
+    pattern_addr = spr_base + tile_index * 16 + fineY;
+  }
+
+  // Get sprite bits
+  uint8_t s_low = mapper->read_ppu(pattern_addr & 0x1FFF);
+  uint8_t s_high = mapper->read_ppu((pattern_addr + 8) & 0x1FFF);
+  uint8_t sb0 = (s_low  >> (7 - px)) & 1;
+  uint8_t sb1 = (s_high >> (7 - px)) & 1;
+  return (sb1 << 1) | sb0;
+}
+
+// Sprite 0 hit without drawing anything, for RENDER_OFF frames. Only dots
+// inside sprite 0's rectangle fetch anything, everything else returns early.
+// The scanline check comes first so lines without sprite 0 cost two compares.
+void PPU::sprite0_hit_only(int xdot, int y) {
+  // hit needs both background and sprites on, and only happens once per frame
+  if (((mask & 0x18) != 0x18) || (status & PPUSTATUS_SPRITE0)) {
+    return;
+  }
+
+  int spriteHeight = (control & 0x20) ? 16 : 8;
+  int sprite_y = (int)OAM[0] + 1;
+  int sprite_x = OAM[3];
+  if ((y < sprite_y) || (y >= (sprite_y + spriteHeight))) {
+    return;
+  }
+  if ((xdot < sprite_x) || (xdot >= (sprite_x + 8))) {
+    return;
+  }
+
+  // left 8 pixels clip either layer
+  if ((xdot < 8) && ((mask & 0x06) != 0x06)) {
+    return;
+  }
+
+  if (sprite_pixel(0, xdot, y) == 0) {
+    return;
+  }
+  uint8_t palette_high_bits;
+  if (background_pixel(xdot, palette_high_bits) != 0) {
+    status |= PPUSTATUS_SPRITE0;
+  }
+}
+
+// Sprite evaluation for the next scanline, done at dot 257 of visible lines.
+// We draw sprites straight from OAM so only the overflow flag comes out of
+// this, including the hardware bug where after 8 sprites the byte index m
+// is incremented together with n and reads tile/attr/x bytes as Y.
+void PPU::evaluate_sprites() {
+  int spriteHeight = (control & 0x20) ? 16 : 8;
+  int found = 0;
+  int n = 0;
+
+  for (; n < 64 && found < 8; ++n) {
+    int row = (int)scanline - (int)OAM[n*4];
+    if ((row >= 0) && (row < spriteHeight)) {
+      found++;
+    }
+  }
+
+  int m = 0;
+  for (; n < 64; ++n) {
+    int row = (int)scanline - (int)OAM[n*4 + m];
+    if ((row >= 0) && (row < spriteHeight)) {
+      status |= PPUSTATUS_OVERFLOW;
+      return;
+    }
+    m = (m + 1) & 3;
+  }
+}
+
+void PPU::render() {
+  // draw visible area pixels
+  if ((scanline >= 240) || (ppu_cycles < 1) || (ppu_cycles > 256)) {
+    return;
+  }
+
+  int y = scanline;
+  int  xdot = ppu_cycles - 1;
+
+  if (xdot == 0) {
+    begin_line();
+  }
+
+  // deferred frame, only notice CHR bank switches and mirroring changes here
+  if (render_mode == RENDER_DEFERRED) {
+    if (mapper->ppu_map_version() != snapshot_map_version) {
+      log_segment(xdot);
+    }
+    sprite0_hit_only(xdot, y);
+    return;
+  }
+
+  // render-off frame, keep the status timing but don't touch the framebuffer
+  if (render_mode == RENDER_OFF) {
+    sprite0_hit_only(xdot, y);
+    return;
+  }
+   
+  bool sprEnabled = (mask & 0x10) != 0; // show sprites
+  bool sprLeft  = (mask & 0x04) != 0; // show sprites in leftmost 8 px
+
+  bool visibleDot = (scanline < 240) && (ppu_cycles >= 1 && ppu_cycles <= 256);
+
+  bool bgEnabled = (mask & 0x08) != 0; // check ppu mask to see if background is enabled
+  bool bgLeft = (mask & 0x02) != 0; // check if background in leftmost 8 px is enabled
+  bool inLeft8 = (xdot < 8);
+
+  uint8_t palette_high_bits;
+  uint8_t color_index = background_pixel(xdot, palette_high_bits);
 
   // Apply left-8/bg enable mask to background pixel
   uint8_t background_color_index = color_index;
@@ -357,8 +844,8 @@ void PPU::render() {
     bg_palette_byte = palette_RAM[((palette_high_bits << 2) | (background_color_index & 0x03)) & 0x1F];
   }
 
-  // update the current pixel with the color.
-  framebuffer[y * 256 + xdot] = nesColor(bg_palette_byte & 0x3F);
+  // the current pixel's color, sprites below can still cover it
+  uint8_t pixel = bg_palette_byte & 0x3F;
 
   // SPRITES
   if (sprEnabled) {
@@ -367,9 +854,8 @@ void PPU::render() {
     int  spriteHeight   = spriteMode8x16 ? 16 : 8;
 
     for (int i = 0; i < 64; ++i) {
-      // OAM entry... find the y position, tile_index index, attribute, and x position
+      // OAM entry... find the y position, attribute, and x position
       uint8_t sprite_y_raw = OAM[i*4 + 0];
-      uint8_t tile_index = OAM[i*4 + 1];
       uint8_t attr = OAM[i*4 + 2];
       uint8_t sprite_x = OAM[i*4 + 3];
 
@@ -382,45 +868,7 @@ void PPU::render() {
         continue;
       }
 
-      // calcualte the pixel in the sprite
-      int col = xdot - sprite_x;
-      int row = y - sprite_y;
-      int px  = (attr & 0x40) ? (7 - col) : col; // horizontal flip
-
-      // Finding the pattern table address for sprite
-      uint16_t pattern_addr;
-
-      if (spriteMode8x16) {
-        uint16_t spr_base = (tile_index & 1) ? 0x1000 : 0x0000;
-        bool vertical_flip = (attr & 0x80) != 0;
-        bool topHalf;
-        uint8_t fineY;
-
-        // getting y pixel and top half based on if vertically flipped
-        if (!vertical_flip) { 
-          topHalf = (row < 8);
-          fineY = row & 7;
-        }
-        else {
-          topHalf = (row >= 8);
-          fineY = 7 - (row & 7);
-        }
-
-        uint8_t  tileIndex = (tile_index & 0xFE) + (topHalf ? 0 : 1);
-        pattern_addr = spr_base + tileIndex * 16 + fineY;
-      } 
-      else { // if in 8x8 mode, then use same pattern table base in PPUCTRL bit 3
-        uint16_t spr_base = (control & 0x08) ? 0x1000 : 0x0000;
-        int fineY = (attr & 0x80) ? (7 - (row & 7)) : (row & 7);
-        pattern_addr = spr_base + tile_index * 16 + fineY;
-      }
-
-      // Get sprite bits
-      uint8_t s_low = mapper->read_ppu(pattern_addr & 0x1FFF);
-      uint8_t s_high = mapper->read_ppu((pattern_addr + 8) & 0x1FFF);
-      uint8_t sb0 = (s_low  >> (7 - px)) & 1;
-      uint8_t sb1 = (s_high >> (7 - px)) & 1;
-      uint8_t sprite_color_index = (sb1 << 1) | sb0;
+      uint8_t sprite_color_index = sprite_pixel(i, xdot, y);
 
       // If we're in the left 8 most pixels, but the left sprite flag is off, don't draw sprite
       bool spriteClipped = inLeft8 && !sprLeft;
@@ -451,11 +899,21 @@ void PPU::render() {
         uint8_t pal = palette_RAM[p_index] & 0x3F;
 
         // Draw sprite pixel
-        framebuffer[y * 256 + xdot] = nesColor(pal);
+        pixel = pal;
         break; // next sprite
       }
     }
   }
+
+  if (render_mode == RENDER_GRAY) {
+    gray->line[xdot] = gray->luma(pixel);
+    if (xdot == 255) {
+      gray->end_line(y);
+    }
+  }
+  else {
+    framebuffer[y * 256 + xdot] = nesColor(pixel);
+  }
 }
 
 
@@ -486,6 +944,18 @@ void PPU::setNMI(bool val) {
   NMI = val;
 }
 
+uint64_t PPU::getFrame() {
+  return frame_count;
+}
+
+void PPU::setRenderMode(RenderMode mode) {
+  next_render_mode = mode;
+}
+
+RenderMode PPU::getRenderMode() {
+  return render_mode;
+}
+
 void PPU::set_oam_address(uint8_t addr) {
     oam_addr = addr;
 }
@@ -2,8 +2,8 @@
 #include <iostream>
 #include <cstdlib>
 #include <stdint.h>
+#include <memory>
 #include <vector>
-#include <SDL2/SDL.h>
 
 #define PPUCTRL 0x2000
 #define PPUMASK 0x2001
@@ -22,13 +22,30 @@ static constexpr uint8_t PPUSTATUS_VBLANK   = 0x80; // bit7
 static constexpr uint8_t PPUSTATUS_SPRITE0  = 0x40; // bit6
 static constexpr uint8_t PPUSTATUS_OVERFLOW = 0x20; // bit5
 
+// What the PPU produces for a frame. RENDER_OFF skips pixel generation and only
+// computes what the CPU can observe: vblank/NMI timing, sprite 0 hit, sprite
+// overflow and the $2007 read buffer.
+enum RenderMode {
+  RENDER_FULL,
+  RENDER_OFF,
+  RENDER_DEFERRED, // RENDER_OFF here, pixels drawn afterwards on worker threads (see deferred.h)
+  RENDER_GRAY      // downsampled luma instead of the framebuffer (see gray.h), needs enableGrayOutput
+};
+
 class CPU; // forward declaration to connect classes
 class Input;
 class Mapper;
+class BackgroundCache;
+class DeferredRenderer;
+class GrayOutput;
+struct VramSnapshot;
+class StateWriter;
+class StateReader;
 class PPU
 {
 public:
   PPU();
+  ~PPU();
   CPU* cpu;
   Input* input;
   void connectCPU(CPU*);
@@ -39,10 +56,27 @@ public:
   void oam_write(uint8_t);
   void set_oam_address(uint8_t);
   void tick();
+  void run(uint32_t dots); // tick a number of dots, skipping idle stretches in one step
+  void enableIdleSkip(bool enable) { idle_skip = enable; } // off ticks every dot, the reference path for lockstep.h
   void render();
   bool getNMI();
   void setNMI(bool);
-  uint32_t nesColor(uint8_t);
+  uint64_t getFrame(); // number of frames completed, bumped at the start of vblank
+  uint16_t getScanline() const { return scanline; } // 0-261, for tracing
+  uint16_t getDot() const { return ppu_cycles; }    // 0-340
+  void setRenderMode(RenderMode); // latched at the prerender line, so it applies to whole frames
+  RenderMode getRenderMode();     // mode of the frame currently being drawn
+  void enableBackgroundCache(bool); // pre-render nametables and copy background lines from them
+  void enableDeferredRender(unsigned threads); // worker threads for RENDER_DEFERRED, 0 = off
+  void finishRender(); // wait for deferred lines, call before reading the framebuffer
+  void enableGrayOutput(int scale, bool max_pool = true); // RENDER_GRAY output at 1/scale size, 0 = off
+  const uint8_t* grayFrame(); // last RENDER_GRAY frame, grayWidth() x grayHeight()
+  int grayWidth();
+  int grayHeight();
+  static uint32_t nesColor(uint8_t);
+  void save_state(StateWriter&) const;
+  bool load_state(StateReader&); // waits for deferred lines and drops cached VRAM
+  void copy_state_from(const PPU&); // same as a load, the framebuffer isn't copied
   uint32_t framebuffer[240 * 256]; //buffer to draw image
   
   void incX();
@@ -52,6 +86,15 @@ public:
 
 
 private:
+    // per-dot pixel helpers used by render()
+    uint8_t background_pixel(int xdot, uint8_t& palette_high_bits);
+    uint8_t sprite_pixel(int i, int xdot, int y);
+    void sprite0_hit_only(int xdot, int y);
+    void evaluate_sprites();
+    void skip_idle(uint32_t pos, uint32_t n);
+    void begin_line();
+    void log_segment(int xdot);
+
     uint8_t control;     // $2000 - PPUCTRL
     uint8_t mask;        // $2001 - PPUMASK
     uint8_t status;      // $2002 - PPUSTATUS
@@ -60,6 +103,23 @@ private:
     uint16_t ppu_cycles; // cycles of ppu - will be used to draw every pixel/cycle (1-256 pixels)
     uint16_t scanline;   // current line being drawn 10-239 is user visible 240-260 is for other purposes
     bool frame_toggle;   // toggle frame
+    uint64_t frame_count; // frames completed so far
+    RenderMode render_mode;      // mode of the current frame
+    RenderMode next_render_mode; // mode requested for the next frame
+
+    // optional nametable pre-render cache and the current line copied out of it
+    std::unique_ptr<BackgroundCache> bg_cache;
+    uint8_t bg_line[256];
+    bool bg_line_valid;
+    bool idle_skip = true;    // run() jumps over idle stretches
+    uint32_t bg_line_version; // mapper PPU mapping version bg_line was built with
+
+    // deferred rendering: workers, and the latest VRAM/palette/OAM snapshot
+    std::unique_ptr<DeferredRenderer> deferred;
+    std::shared_ptr<const VramSnapshot> vram_snapshot;
+    std::unique_ptr<GrayOutput> gray; // RENDER_GRAY output
+    bool vram_changed;             // contents changed since vram_snapshot
+    uint32_t snapshot_map_version; // mapper PPU mapping version of vram_snapshot
     bool NMI; //non-maskable interrupt
     uint16_t vram_addr = 0;  // current VRAM address (15 bits)
     uint16_t temp_vram = 0;  // temp VRAM address (15 bits)
@@ -69,12 +129,7 @@ private:
 
 
   //Remember the pattern tables, name tables, and pallete_ram are all part of the Vram, but not OAM
-
-  // 2 Pattern Tables - (2) * 4 KB = 8 KB
-  uint8_t pattern_table[0x2000]; // $0000-$1FFF
-  
-  //4 Name Tables - (4) * 1 KB = 4 KB
-  uint8_t name_tables[0x1000]; //$2000-$2FFF
+  //Pattern tables ($0000-$1FFF) and name tables ($2000-$2FFF) live on the cartridge, the mapper owns them
 
   //Palette RAM - 32 Bytes
   uint8_t palette_RAM[32]; // $3F00-$3FFF
@@ -126,4 +181,4 @@ private:
  * coordinate, the sprite tile number, the sprite attribute, 
  * and the sprite X coordinate. 
  * 
- */ 
\ No newline at end of file
+ */ 
\ No newline at end of file
@@ -0,0 +1,224 @@
+#include "rewind.h"
+#include <cstring>
+
+// equal stretches shorter than this stay inside a literal, a new token costs
+// about as much
+static constexpr size_t MIN_RUN = 4;
+
+static inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint8_t* put_varint(uint8_t* p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline size_t get_varint(const uint8_t*& p) {
+    size_t v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        v |= (size_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    v |= (size_t)(*p++) << shift;
+    return v;
+}
+
+RewindBuffer::RewindBuffer(size_t capacity_bytes, int interval)
+    : storage(capacity_bytes), head(0), used(0), keyframe_interval(interval > 0 ? interval : 1),
+      next_serial(0), key_serial(0), key_valid(false) {
+}
+
+void RewindBuffer::push(const std::vector<uint8_t>& state) {
+    bool keyframe = !key_valid || state.size() != key_state.size() ||
+                    next_serial - key_serial >= (uint64_t)keyframe_interval;
+    if (keyframe) {
+        if (zeros.size() != state.size()) {
+            zeros.assign(state.size(), 0);
+        }
+        encode(state.data(), zeros.data(), state.size(), scratch);
+        key_state = state;
+        key_serial = next_serial;
+        key_valid = true;
+    }
+    else {
+        encode(state.data(), key_state.data(), state.size(), scratch);
+    }
+
+    if (store(scratch, key_serial)) {
+        next_serial++;
+    }
+    else {
+        key_valid = false; // start over with a keyframe next time
+    }
+}
+
+bool RewindBuffer::pop(std::vector<uint8_t>& state) {
+    if (entries.empty()) {
+        return false;
+    }
+
+    Entry entry = entries.back();
+    if (!key_valid || key_serial != entry.key) {
+        load_key(entry);
+    }
+    if (entry.serial == entry.key) {
+        state = key_state;
+        key_valid = false; // about to be removed, the next push starts a new keyframe
+    }
+    else {
+        decode(&storage[entry.offset], entry.size, key_state.data(), state);
+    }
+
+    // the newest entry ends at head, so its space is free again
+    entries.pop_back();
+    used -= entry.size;
+    head = entry.offset;
+    next_serial = entry.serial;
+    return true;
+}
+
+void RewindBuffer::clear() {
+    entries.clear();
+    head = 0;
+    used = 0;
+    key_valid = false;
+}
+
+bool RewindBuffer::empty() const {
+    return entries.empty();
+}
+
+size_t RewindBuffer::count() const {
+    return entries.size();
+}
+
+size_t RewindBuffer::bytes_used() const {
+    return used;
+}
+
+// Entries sit in storage in push order, wrapping to the start when the end
+// is reached. Everything at or after head is older than everything before it.
+bool RewindBuffer::store(const std::vector<uint8_t>& encoded, uint64_t key) {
+    size_t size = encoded.size();
+    if (size > storage.size()) {
+        return false;
+    }
+
+    if (head + size > storage.size()) {
+        // not enough room at the end, what's left there is the oldest
+        while (!entries.empty() && entries.front().offset >= head) {
+            drop_oldest();
+        }
+        head = 0;
+    }
+    while (!entries.empty() && entries.front().offset >= head && entries.front().offset < head + size) {
+        drop_oldest();
+    }
+
+    // a delta whose keyframe just got evicted can't be decoded
+    if (next_serial != key && !key_valid) {
+        return false;
+    }
+
+    std::memcpy(&storage[head], encoded.data(), size);
+    entries.push_back({head, size, next_serial, key});
+    head += size;
+    used += size;
+    return true;
+}
+
+// Evict the oldest state along with every delta that depends on it, so the
+// oldest entry left is always a keyframe
+void RewindBuffer::drop_oldest() {
+    do {
+        const Entry& entry = entries.front();
+        if (entry.serial == key_serial) {
+            key_valid = false;
+        }
+        used -= entry.size;
+        entries.pop_front();
+    } while (!entries.empty() && entries.front().serial != entries.front().key);
+}
+
+void RewindBuffer::load_key(const Entry& entry) {
+    // serials are consecutive from the front
+    const Entry& key = entries[entry.key - entries.front().serial];
+    decode(&storage[key.offset], key.size, nullptr, key_state);
+    key_serial = key.serial;
+    key_valid = true;
+}
+
+// Format: varint state size, then tokens of (varint equal bytes, varint
+// literal bytes, literal bytes XORed with the base) until the size is covered
+void RewindBuffer::encode(const uint8_t* state, const uint8_t* base, size_t size, std::vector<uint8_t>& out) {
+    // every token but the first consumes at least MIN_RUN + 1 bytes, its
+    // two varints never take more than 2 * 10
+    out.resize(size + (size / (MIN_RUN + 1) + 2) * 20);
+    uint8_t* p = put_varint(out.data(), size);
+
+    size_t i = 0;
+    while (i < size) {
+        size_t run_start = i;
+        while (i + 8 <= size && load64(state + i) == load64(base + i)) {
+            i += 8;
+        }
+        while (i < size && state[i] == base[i]) {
+            i++;
+        }
+
+        size_t literal_start = i;
+        while (i < size) {
+            if (state[i] != base[i]) {
+                i++;
+                continue;
+            }
+            size_t j = i;
+            while (j < size && j - i < MIN_RUN && state[j] == base[j]) {
+                j++;
+            }
+            if (j - i >= MIN_RUN || j == size) {
+                break;
+            }
+            i = j;
+        }
+
+        p = put_varint(p, literal_start - run_start);
+        p = put_varint(p, i - literal_start);
+        for (size_t k = literal_start; k < i; k++) {
+            *p++ = state[k] ^ base[k];
+        }
+    }
+    out.resize(p - out.data());
+}
+
+void RewindBuffer::decode(const uint8_t* data, size_t data_size, const uint8_t* base, std::vector<uint8_t>& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + data_size;
+    size_t size = get_varint(p);
+    out.resize(size);
+    if (base) {
+        std::memcpy(out.data(), base, size);
+    }
+    else {
+        std::memset(out.data(), 0, size);
+    }
+
+    size_t i = 0;
+    while (p < end) {
+        i += get_varint(p);
+        size_t literal = get_varint(p);
+        for (size_t k = 0; k < literal; k++) {
+            out[i + k] ^= p[k];
+        }
+        p += literal;
+        i += literal;
+    }
+}
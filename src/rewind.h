@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/*
+ * Rewind history: save states (see savestate.h) kept in one fixed block of
+ * memory, oldest dropped first when it fills up.
+ *
+ * Every keyframe_interval-th state is a keyframe, the ones in between are
+ * stored as the XOR against their keyframe. Frame to frame only a few
+ * hundred bytes of RAM, OAM and registers change, so a delta is almost all
+ * zeros and run-length coding shrinks it to the bytes that differ. Keyframes
+ * are run-length coded the same way against zeros. Decoding any state needs
+ * just it and its keyframe, and the last decoded keyframe is kept around, so
+ * stepping backwards decodes one delta per step.
+ */
+class RewindBuffer {
+public:
+    explicit RewindBuffer(size_t capacity_bytes = 20 << 20, int keyframe_interval = 60);
+
+    // Append the newest state, evicting the oldest ones if there's no room
+    void push(const std::vector<uint8_t>& state);
+
+    // Take off the newest state, false when there's nothing left
+    bool pop(std::vector<uint8_t>& state);
+
+    void clear();
+    bool empty() const;
+    size_t count() const;      // states held
+    size_t bytes_used() const; // compressed size of the states held
+
+private:
+    struct Entry {
+        size_t offset;   // where the encoded bytes sit in storage
+        size_t size;
+        uint64_t serial; // push counter, keeps counting across evictions
+        uint64_t key;    // serial of the keyframe it's a delta against (its own for keyframes)
+    };
+
+    bool store(const std::vector<uint8_t>& encoded, uint64_t key);
+    void drop_oldest();
+    void load_key(const Entry& entry);
+
+    static void encode(const uint8_t* state, const uint8_t* base, size_t size, std::vector<uint8_t>& out);
+    static void decode(const uint8_t* data, size_t data_size, const uint8_t* base, std::vector<uint8_t>& out);
+
+    std::vector<uint8_t> storage;
+    std::deque<Entry> entries; // oldest first
+    size_t head;               // where the next entry goes
+    size_t used;
+    int keyframe_interval;
+    uint64_t next_serial;
+
+    std::vector<uint8_t> key_state; // decoded copy of keyframe key_serial
+    uint64_t key_serial;
+    bool key_valid;                 // key_state is a keyframe that's still stored
+    std::vector<uint8_t> zeros;     // base for coding keyframes
+    std::vector<uint8_t> scratch;
+};
@@ -0,0 +1,164 @@
+#include "rollback.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "console.h"
+
+// Packet: uint32 first frame, uint8 count, count input bytes, then the
+// highest frame of the receiver's input the sender has (int32, -1 for none)
+
+RollbackSession::RollbackSession(Transport& transport_ref, int player, Console& console_ref, RenderMode mode,
+                                 int delay)
+    : transport(transport_ref), local_player(player), console(console_ref), present_mode(mode),
+      input_delay(delay < 0 ? 0 : delay), current(0),
+      remote_confirmed(-1), remote_acked(-1), mispredicted(-1), rollback_ms_total(0) {
+    std::memset(local_inputs, 0, sizeof(local_inputs));
+    std::memset(remote_inputs, 0, sizeof(remote_inputs));
+    std::memset(used_remote, 0, sizeof(used_remote));
+
+    // the first input_delay frames have no local input, they run with none
+    local_last = input_delay - 1;
+}
+
+bool RollbackSession::advance_frame(uint8_t local_buttons) {
+    poll();
+
+    // Predicting further than a rollback could repair isn't allowed, wait
+    // (still resending, the peer may have lost our packets)
+    if ((int64_t)current - remote_confirmed > MAX_ROLLBACK) {
+        stats.stalls++;
+        send_inputs();
+        return false;
+    }
+
+    local_last = current + input_delay;
+    local_inputs[local_last % INPUT_HISTORY] = local_buttons;
+    send_inputs();
+
+    if (mispredicted >= 0) {
+        rollback((uint32_t)mispredicted);
+        mispredicted = -1;
+    }
+    simulate(current, true);
+    current++;
+    stats.frames++;
+    return true;
+}
+
+void RollbackSession::poll() {
+    while (transport.receive(packet)) {
+        if (packet.size() < 5) {
+            continue;
+        }
+        uint32_t first;
+        std::memcpy(&first, packet.data(), 4);
+        uint32_t count = packet[4];
+        if (packet.size() < 5 + count + 4) {
+            continue;
+        }
+        int32_t ack;
+        std::memcpy(&ack, packet.data() + 5 + count, 4);
+        if (ack > remote_acked) {
+            remote_acked = ack;
+        }
+
+        // take inputs only in order, a gap is filled by a later resend
+        for (uint32_t i = 0; i < count; i++) {
+            int64_t frame = (int64_t)first + i;
+            if (frame != remote_confirmed + 1) {
+                continue;
+            }
+            uint8_t buttons = packet[5 + i];
+            remote_inputs[frame % INPUT_HISTORY] = buttons;
+            remote_confirmed = frame;
+            if (frame < current && used_remote[frame % INPUT_HISTORY] != buttons &&
+                (mispredicted < 0 || frame < mispredicted)) {
+                mispredicted = frame;
+            }
+        }
+    }
+}
+
+void RollbackSession::send_inputs() {
+    // oldest first, the peer can only use them in order
+    int64_t first = remote_acked + 1;
+    int64_t pending = local_last - first + 1;
+    uint32_t count = (uint32_t)(pending < 0 ? 0 : (pending > MAX_SEND ? MAX_SEND : pending));
+
+    uint8_t out[5 + MAX_SEND + 4];
+    uint32_t first32 = (uint32_t)first;
+    std::memcpy(out, &first32, 4);
+    out[4] = (uint8_t)count;
+    for (uint32_t i = 0; i < count; i++) {
+        out[5 + i] = local_inputs[(first + i) % INPUT_HISTORY];
+    }
+    int32_t ack = (int32_t)remote_confirmed;
+    std::memcpy(out + 5 + count, &ack, 4);
+    transport.send(out, 5 + count + 4);
+}
+
+// Load the snapshot from the start of to_frame and run up to the current
+// frame again with what's now known of the peer's input
+void RollbackSession::rollback(uint32_t to_frame) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<uint8_t>& snapshot = snapshots[to_frame % SNAPSHOTS];
+    console.load_state(snapshot.data(), snapshot.size());
+    for (uint32_t frame = to_frame; frame < current; frame++) {
+        simulate(frame, false);
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    int depth = (int)(current - to_frame);
+    stats.rollbacks++;
+    stats.resimulated += depth;
+    if (depth > stats.max_depth) {
+        stats.max_depth = depth;
+    }
+    if (ms > stats.max_rollback_ms) {
+        stats.max_rollback_ms = ms;
+    }
+    rollback_ms_total += ms;
+}
+
+void RollbackSession::simulate(uint32_t frame, bool present) {
+    console.save_state(snapshots[frame % SNAPSHOTS]);
+
+    uint8_t local = local_inputs[frame % INPUT_HISTORY];
+    uint8_t remote = remote_buttons(frame);
+    used_remote[frame % INPUT_HISTORY] = remote;
+    if (local_player == 0) {
+        console.set_buttons(local, remote);
+    }
+    else {
+        console.set_buttons(remote, local);
+    }
+
+    // frames run again were already heard and seen once
+    console.get_ppu().setRenderMode(present ? present_mode : RENDER_OFF);
+    console.get_apu().set_muted(!present);
+    console.run_frame();
+    console.get_apu().set_muted(false);
+}
+
+// Real input when it's known, else the last known buttons held
+uint8_t RollbackSession::remote_buttons(uint32_t frame) const {
+    if ((int64_t)frame <= remote_confirmed) {
+        return remote_inputs[frame % INPUT_HISTORY];
+    }
+    return remote_confirmed >= 0 ? remote_inputs[remote_confirmed % INPUT_HISTORY] : 0;
+}
+
+NetplayStats RollbackSession::get_stats() const {
+    NetplayStats result = stats;
+    result.mean_rollback_ms = stats.rollbacks ? rollback_ms_total / stats.rollbacks : 0;
+    return result;
+}
+
+void RollbackSession::print_stats() const {
+    NetplayStats s = get_stats();
+    printf("Netplay: %llu frames, %llu stalls\n", (unsigned long long)s.frames, (unsigned long long)s.stalls);
+    printf("  rollbacks %llu  frames resimulated %llu  deepest %d\n", (unsigned long long)s.rollbacks,
+           (unsigned long long)s.resimulated, s.max_depth);
+    printf("  rollback time mean %.3f ms  max %.3f ms\n", s.mean_rollback_ms, s.max_rollback_ms);
+}
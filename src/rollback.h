@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "ppu.h"
+#include "transport.h"
+
+class Console;
+
+// Rollback statistics (times in milliseconds)
+struct NetplayStats {
+    uint64_t frames = 0;        // frames run forward
+    uint64_t stalls = 0;        // host frames skipped waiting for the peer
+    uint64_t rollbacks = 0;     // mispredictions repaired
+    uint64_t resimulated = 0;   // frames run again because of them
+    int max_depth = 0;          // most frames rolled back at once
+    double mean_rollback_ms = 0; // restore plus re-simulation
+    double max_rollback_ms = 0;
+};
+
+/*
+ * Two player rollback netplay (GGPO style).
+ *
+ * Each side runs ahead on its own input and a prediction of the peer's (the
+ * peer's last known buttons), snapshotting the start of every frame. Inputs
+ * go out every frame together with all earlier ones the peer hasn't
+ * acknowledged, so a lost packet is covered by the next. When the peer's
+ * real input for a past frame turns out different from the prediction, the
+ * session loads that frame's snapshot and runs every frame since again,
+ * muted and without drawing, before the current frame, all within the one
+ * host frame. It never predicts more than MAX_ROLLBACK frames past the
+ * peer's last confirmed input; at that point it stalls until the peer
+ * catches up.
+ *
+ * Both sides have to start from the same state (power on with the same ROM,
+ * or the same save state loaded).
+ */
+class RollbackSession {
+public:
+    static constexpr int MAX_ROLLBACK = 8;
+
+    // local_player 0 drives controller 1, 1 drives controller 2. Local input
+    // is applied input_delay frames late, which hides that much latency
+    // without any rollback.
+    RollbackSession(Transport& transport, int local_player, Console& console, RenderMode present_mode,
+                    int input_delay = 1);
+
+    // One host frame: exchange inputs, repair any misprediction and run the
+    // next frame drawn with present_mode. Returns false if it had to stall,
+    // in which case the machine didn't move.
+    bool advance_frame(uint8_t local_buttons);
+
+    uint32_t frame() const { return current; } // next frame to run
+    NetplayStats get_stats() const;
+    void print_stats() const;
+
+private:
+    static constexpr uint32_t INPUT_HISTORY = 128; // power of two, well past MAX_ROLLBACK plus the delay
+    static constexpr int SNAPSHOTS = MAX_ROLLBACK + 1;
+    static constexpr uint32_t MAX_SEND = 64;
+
+    void poll();
+    void send_inputs();
+    void rollback(uint32_t to_frame);
+    void simulate(uint32_t frame, bool present);
+    uint8_t remote_buttons(uint32_t frame) const;
+
+    Transport& transport;
+    int local_player;
+    Console& console;
+    RenderMode present_mode;
+    int input_delay;
+
+    uint32_t current;
+    uint8_t local_inputs[INPUT_HISTORY];
+    uint8_t remote_inputs[INPUT_HISTORY];
+    uint8_t used_remote[INPUT_HISTORY];  // what each run frame was given for the peer
+    int64_t local_last;        // last frame with local input
+    int64_t remote_confirmed;  // peer's input is known for every frame up to here
+    int64_t remote_acked;      // peer has all of our input up to here
+    int64_t mispredicted;      // earliest run frame whose prediction was wrong, -1 for none
+    std::vector<uint8_t> snapshots[SNAPSHOTS]; // start of frame f in slot f % SNAPSHOTS
+    std::vector<uint8_t> packet;
+
+    NetplayStats stats;
+    double rollback_ms_total;
+};
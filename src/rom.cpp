@@ -0,0 +1,126 @@
+#include "rom.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint8_t INES_MAGIC[4] = {'N', 'E', 'S', 0x1A};
+
+std::shared_ptr<const RomImage> RomImage::load(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        fprintf(stderr, "No file found: %s\n", path.c_str());
+        return nullptr;
+    }
+    std::shared_ptr<RomImage> image(new RomImage());
+    uint8_t chunk[65536];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        image->file.insert(image->file.end(), chunk, chunk + got);
+    }
+    fclose(f);
+
+    if (!image->parse(image->file.data(), image->file.size(), path)) {
+        return nullptr;
+    }
+    return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::map(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "No file found: %s\n", path.c_str());
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        fprintf(stderr, "%s isn't an iNES file\n", path.c_str());
+        close(fd);
+        return nullptr;
+    }
+    void* mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    std::shared_ptr<RomImage> image(new RomImage());
+    image->mapping = mapped;
+    image->mapping_size = (size_t)info.st_size;
+    if (!image->parse((const uint8_t*)mapped, image->mapping_size, path)) {
+        return nullptr;
+    }
+    return image;
+}
+
+RomImage::~RomImage() {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+// Header (see the iNES notes in cpu.h), then an optional 512 byte trainer,
+// PRG and CHR. Only points into data, which has to outlive the image.
+bool RomImage::parse(const uint8_t* data, size_t size, const std::string& path) {
+    if (size < 16 || memcmp(data, INES_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s isn't an iNES file\n", path.c_str());
+        return false;
+    }
+    size_t offset = 16 + ((data[6] & 0x04) ? 512 : 0);
+    prg_bytes = data[4] * 16384;
+    chr_bytes = data[5] * 8192;
+    if (prg_bytes == 0 || size < offset + prg_bytes + chr_bytes) {
+        fprintf(stderr, "%s is cut short (expected %zu bytes of PRG and %zu of CHR)\n", path.c_str(),
+                prg_bytes, chr_bytes);
+        return false;
+    }
+    prg_data = data + offset;
+    chr_data = chr_bytes ? prg_data + prg_bytes : nullptr;
+    mapper_number = (data[7] & 0xF0) | (data[6] >> 4);
+    vertical = (data[6] & 0x01) != 0;
+    return true;
+}
+
+bool RomImage::same_game(const RomImage& other) const {
+    if (this == &other) {
+        return true;
+    }
+    return mapper_number == other.mapper_number && vertical == other.vertical &&
+           prg_bytes == other.prg_bytes && chr_bytes == other.chr_bytes &&
+           memcmp(prg_data, other.prg_data, prg_bytes) == 0 &&
+           (chr_bytes == 0 || memcmp(chr_data, other.chr_data, chr_bytes) == 0);
+}
+
+std::shared_ptr<const RomImage> RomCache::load(const std::string& path) {
+    // held across the load so two threads asking at once read the file once
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<const RomImage> image = images[path].lock();
+    if (!image) {
+        image = map_files ? RomImage::map(path) : RomImage::load(path);
+        if (image) {
+            images[path] = image;
+        }
+        else {
+            images.erase(path);
+        }
+    }
+    return image;
+}
+
+size_t RomCache::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t alive = 0;
+    for (auto it = images.begin(); it != images.end();) {
+        if (it->second.expired()) {
+            it = images.erase(it);
+        }
+        else {
+            alive++;
+            ++it;
+        }
+    }
+    return alive;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * A cartridge's ROM, read from an iNES file. PRG and CHR-ROM never change
+ * once loaded, so every mapper running the game shares one image through a
+ * shared_ptr and owns only its RAM.
+ */
+class RomImage {
+public:
+    // nullptr (with a message on stderr) if the file can't be read or isn't
+    // an iNES image
+    static std::shared_ptr<const RomImage> load(const std::string& path);
+
+    // Same, but maps the file read-only instead of reading it (POSIX). The
+    // header is checked in place and PRG/CHR point straight into the
+    // mapping, so nothing is copied and the pages are shared through the
+    // page cache with every process mapping the same file. The file must
+    // not be rewritten while mapped.
+    static std::shared_ptr<const RomImage> map(const std::string& path);
+
+    ~RomImage();
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+
+    const uint8_t* prg() const { return prg_data; }
+    size_t prg_size() const { return prg_bytes; }
+    const uint8_t* chr() const { return chr_data; }
+    size_t chr_size() const { return chr_bytes; } // 0 when the board has CHR-RAM instead
+    uint8_t mapper() const { return mapper_number; }
+    bool vertical_mirroring() const { return vertical; }
+
+    // Whether other is the same cartridge: the very same image, or one with
+    // the same board and the same PRG and CHR bytes (compared in full)
+    bool same_game(const RomImage& other) const;
+
+private:
+    RomImage() = default;
+    bool parse(const uint8_t* data, size_t size, const std::string& path);
+
+    std::vector<uint8_t> file; // the whole .nes file when read, PRG and CHR point into it
+    void* mapping = nullptr;   // or the whole file mapped
+    size_t mapping_size = 0;
+    const uint8_t* prg_data = nullptr;
+    size_t prg_bytes = 0;
+    const uint8_t* chr_data = nullptr;
+    size_t chr_bytes = 0;
+    uint8_t mapper_number = 0;
+    bool vertical = false;
+};
+
+/*
+ * Loads each ROM file once: while any console still holds an image, asking
+ * for the same path again returns that image. Once the last holder lets go
+ * the image is freed and the next request reads the file again. Thread safe.
+ */
+class RomCache {
+public:
+    explicit RomCache(bool map_files = false) : map_files(map_files) {}
+
+    // RomImage::map or RomImage::load, as the cache was made
+    std::shared_ptr<const RomImage> load(const std::string& path);
+    size_t size(); // images currently alive
+
+private:
+    bool map_files;
+    std::mutex lock;
+    std::unordered_map<std::string, std::weak_ptr<const RomImage>> images;
+};
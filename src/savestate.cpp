@@ -0,0 +1,121 @@
+#include "savestate.h"
+#include <cstring>
+#include "cpu.h"
+#include "ppu.h"
+#include "apu.h"
+#include "input.h"
+
+static const uint8_t STATE_MAGIC[4] = {'N', 'E', 'S', 'S'};
+static constexpr size_t CHUNK_HEADER = 4 + 2 + 4;
+
+StateWriter::StateWriter(std::vector<uint8_t>& out_ref) : out(out_ref), chunk_start(0) {
+    out.clear();
+    write(STATE_MAGIC, sizeof(STATE_MAGIC));
+    put(STATE_FORMAT_VERSION);
+}
+
+void StateWriter::begin_chunk(uint32_t tag, uint16_t version) {
+    put(tag);
+    put(version);
+    chunk_start = out.size();
+    put((uint32_t)0); // size, patched in end_chunk
+}
+
+void StateWriter::end_chunk() {
+    uint32_t size = (uint32_t)(out.size() - chunk_start - sizeof(uint32_t));
+    std::memcpy(&out[chunk_start], &size, sizeof(size));
+}
+
+void StateWriter::write(const void* data, size_t size) {
+    size_t pos = out.size();
+    out.resize(pos + size);
+    std::memcpy(&out[pos], data, size);
+}
+
+StateReader::StateReader(const uint8_t* data, size_t size)
+    : cursor(nullptr), end(nullptr), is_valid(false), failed(true) {
+    uint32_t format;
+    if (size < sizeof(STATE_MAGIC) + sizeof(format) || std::memcmp(data, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0) {
+        return;
+    }
+    std::memcpy(&format, data + 4, sizeof(format));
+    if (format != STATE_FORMAT_VERSION) {
+        return;
+    }
+
+    size_t pos = 8;
+    while (pos < size) {
+        if (size - pos < CHUNK_HEADER) {
+            return;
+        }
+        Chunk chunk;
+        uint32_t chunk_size;
+        std::memcpy(&chunk.tag, data + pos, 4);
+        std::memcpy(&chunk.version, data + pos + 4, 2);
+        std::memcpy(&chunk_size, data + pos + 6, 4);
+        pos += CHUNK_HEADER;
+        if (size - pos < chunk_size) {
+            return;
+        }
+        chunk.data = data + pos;
+        chunk.size = chunk_size;
+        chunks.push_back(chunk);
+        pos += chunk_size;
+    }
+    is_valid = true;
+    failed = false;
+}
+
+bool StateReader::valid() const {
+    return is_valid;
+}
+
+bool StateReader::open_chunk(uint32_t tag, uint16_t& version) {
+    for (const Chunk& chunk : chunks) {
+        if (chunk.tag == tag) {
+            version = chunk.version;
+            cursor = chunk.data;
+            end = chunk.data + chunk.size;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool StateReader::read(void* data, size_t size) {
+    if (failed || (size_t)(end - cursor) < size) {
+        failed = true;
+        return false;
+    }
+    std::memcpy(data, cursor, size);
+    cursor += size;
+    return true;
+}
+
+bool StateReader::ok() const {
+    return !failed;
+}
+
+void save_state(std::vector<uint8_t>& out, const CPU& cpu, const PPU& ppu, const APU& apu, const Input& input) {
+    StateWriter writer(out);
+    cpu.save_state(writer);
+    cpu.mapper->save_state(writer);
+    ppu.save_state(writer);
+    apu.save_state(writer);
+    input.save_state(writer);
+}
+
+bool load_state(const uint8_t* data, size_t size, CPU& cpu, PPU& ppu, APU& apu, Input& input) {
+    StateReader reader(data, size);
+    if (!reader.valid()) {
+        return false;
+    }
+
+    // the mapper goes first, a state from another board fails before
+    // anything has been touched
+    return cpu.mapper->load_state(reader) &&
+           cpu.load_state(reader) &&
+           ppu.load_state(reader) &&
+           apu.load_state(reader) &&
+           input.load_state(reader);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Save state format
+ *
+ *   header: "NESS", uint32 format version
+ *   chunks: uint32 tag, uint16 chunk version, uint32 payload size, payload
+ *
+ * Each component writes one chunk with its own tag and version, so a
+ * component can change its layout (bump its chunk version) without touching
+ * the others, and loaders skip chunks they don't know. Only live state goes
+ * in: registers, RAM that the emulated hardware can actually read back, and
+ * timing counters. ROM, lookup tables, caches and host-side settings (render
+ * mode, audio device) are left out. Values are stored in host byte order,
+ * states are meant for the machine that made them.
+ */
+
+static constexpr uint32_t STATE_FORMAT_VERSION = 1;
+
+// chunk tag from four characters, e.g. state_tag("CPU ")
+constexpr uint32_t state_tag(const char (&s)[5]) {
+    return (uint32_t)(uint8_t)s[0] | ((uint32_t)(uint8_t)s[1] << 8) |
+           ((uint32_t)(uint8_t)s[2] << 16) | ((uint32_t)(uint8_t)s[3] << 24);
+}
+
+class StateWriter {
+public:
+    // Clears out (keeping its capacity, so reusing a buffer doesn't allocate)
+    // and writes the header
+    explicit StateWriter(std::vector<uint8_t>& out);
+
+    void begin_chunk(uint32_t tag, uint16_t version);
+    void end_chunk();
+
+    void write(const void* data, size_t size);
+
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data goes into a state");
+        write(&value, sizeof(T));
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    size_t chunk_start; // offset of the open chunk's size field
+};
+
+class StateReader {
+public:
+    // Checks the header and indexes the chunks, see valid()
+    StateReader(const uint8_t* data, size_t size);
+
+    bool valid() const; // header and chunk sizes check out
+
+    // Start reading a chunk, false if it isn't there
+    bool open_chunk(uint32_t tag, uint16_t& version);
+
+    // Read from the open chunk. Running past its end fails this and every
+    // later read, so a component can read everything and check ok() once.
+    bool read(void* data, size_t size);
+
+    template <typename T>
+    bool get(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data comes out of a state");
+        return read(&value, sizeof(T));
+    }
+
+    bool ok() const;
+
+private:
+    struct Chunk {
+        uint32_t tag;
+        uint16_t version;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    const uint8_t* cursor;
+    const uint8_t* end;
+    bool is_valid;
+    bool failed;
+};
+
+class CPU;
+class PPU;
+class APU;
+class Input;
+
+// Snapshot of the whole machine, the mapper is reached through the CPU
+void save_state(std::vector<uint8_t>& out, const CPU& cpu, const PPU& ppu, const APU& apu, const Input& input);
+
+// Restore a snapshot taken with the same ROM. Returns false if the data is
+// malformed or for another mapper; a state that fails part way through can
+// leave the machine half restored.
+bool load_state(const uint8_t* data, size_t size, CPU& cpu, PPU& ppu, APU& apu, Input& input);
@@ -0,0 +1,386 @@
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "batch_env.h"
+#include "console.h"
+#include "movie.h"
+#include "rewind.h"
+#include "savestate.h"
+
+/*
+ * Checks for the code that saves, restores, replays, forks and batches
+ * machines, run on Super Mario Bros. with a fixed button pattern. Each check prints a line,
+ * exit code 0 when all of them pass.
+ */
+
+static const char* const ROM = "testing/Super_mario_brothers.nes";
+
+// Start the game, then run right and jump now and then
+static uint8_t buttons_at(int frame) {
+    if (frame < 40) {
+        return 0;
+    }
+    if (frame < 46) {
+        return BUTTON_START;
+    }
+    return BUTTON_RIGHT | BUTTON_B | ((frame / 20) % 3 == 0 ? BUTTON_A : 0);
+}
+
+static std::unique_ptr<Console> power_on() {
+    std::unique_ptr<Console> console(new Console());
+    if (!console->load_rom(ROM)) {
+        return nullptr;
+    }
+    console->get_apu().set_muted(true);
+    return console;
+}
+
+static void run(Console& console, int first, int count) {
+    for (int frame = first; frame < first + count; frame++) {
+        console.set_buttons(buttons_at(frame), 0);
+        console.run_frame();
+    }
+}
+
+// save, run on, load, run the same frames again: same picture, and saving
+// again gives the very same bytes
+static bool savestate_round_trip(std::string& detail) {
+    std::unique_ptr<Console> console = power_on();
+    if (!console) {
+        detail = "can't load the ROM";
+        return false;
+    }
+    run(*console, 0, 150);
+    std::vector<uint8_t> state;
+    console->save_state(state);
+    run(*console, 150, 60);
+    uint64_t first = console->frame_hash();
+
+    if (!console->load_state(state.data(), state.size())) {
+        detail = "load_state refused its own state";
+        return false;
+    }
+    std::vector<uint8_t> again;
+    console->save_state(again);
+    if (again != state) {
+        detail = "saving after a load gives different bytes";
+        return false;
+    }
+    run(*console, 150, 60);
+    if (console->frame_hash() != first) {
+        detail = "frame hash differs after the reload";
+        return false;
+    }
+    return true;
+}
+
+// truncated or mislabelled states are refused, and a truncated one before
+// anything is touched
+static bool savestate_rejects_bad(std::string& detail) {
+    std::unique_ptr<Console> console = power_on();
+    if (!console) {
+        detail = "can't load the ROM";
+        return false;
+    }
+    run(*console, 0, 100);
+    std::vector<uint8_t> state;
+    console->save_state(state);
+
+    for (size_t size : {state.size() - 1, state.size() / 2, (size_t)6}) {
+        if (console->load_state(state.data(), size)) {
+            detail = "a truncated state loaded";
+            return false;
+        }
+    }
+    std::vector<uint8_t> after;
+    console->save_state(after);
+    if (after != state) {
+        detail = "a refused state changed the machine";
+        return false;
+    }
+
+    std::vector<uint8_t> bad = state;
+    bad[0] = 'X'; // magic
+    if (console->load_state(bad.data(), bad.size())) {
+        detail = "a state with a wrong magic loaded";
+        return false;
+    }
+    bad = state;
+    bad[8] ^= 0x20; // tag of the first chunk, which then goes missing
+    if (console->load_state(bad.data(), bad.size())) {
+        detail = "a state with a wrong chunk tag loaded";
+        return false;
+    }
+    return true;
+}
+
+// Rewind over a few keyframes in a buffer small enough to wrap around and
+// evict, then step back: every state comes out byte for byte as pushed,
+// also after pushing again from a state stepped back to
+static bool rewind_steps_back(std::string& detail) {
+    std::unique_ptr<Console> console = power_on();
+    if (!console) {
+        detail = "can't load the ROM";
+        return false;
+    }
+    RewindBuffer rewind(64 << 10, 8);
+    std::vector<std::vector<uint8_t>> pushed;
+    std::vector<uint8_t> state;
+    for (int frame = 0; frame < 300; frame++) {
+        console->save_state(state);
+        rewind.push(state);
+        pushed.push_back(state);
+        run(*console, frame, 1);
+    }
+    if (rewind.count() >= pushed.size() || rewind.count() < 3 * 8) {
+        detail = "expected the ring to wrap and keep a few keyframes, holds " + std::to_string(rewind.count());
+        return false;
+    }
+
+    // back 13 (over a keyframe), then on again from there
+    for (int i = 0; i < 13; i++) {
+        if (!rewind.pop(state) || state != pushed.back()) {
+            detail = "state " + std::to_string(pushed.size() - 1) + " came back different";
+            return false;
+        }
+        pushed.pop_back();
+    }
+    console->load_state(state.data(), state.size());
+    for (int frame = 0; frame < 40; frame++) {
+        console->save_state(state);
+        rewind.push(state);
+        pushed.push_back(state);
+        run(*console, 300 + frame, 1);
+    }
+
+    size_t held = rewind.count();
+    for (size_t i = 0; i < held; i++) {
+        if (!rewind.pop(state) || state != pushed[pushed.size() - 1 - i]) {
+            detail = "state " + std::to_string(pushed.size() - 1 - i) + " came back different";
+            return false;
+        }
+    }
+    if (!rewind.empty() || rewind.pop(state)) {
+        detail = "states left after popping all of them";
+        return false;
+    }
+    return true;
+}
+
+// Record a movie from the middle of a game, save and load it, and play it
+// on a fresh console: it ends on the picture the recording did
+static bool movie_round_trip(std::string& detail) {
+    std::unique_ptr<Console> console = power_on();
+    if (!console) {
+        detail = "can't load the ROM";
+        return false;
+    }
+    run(*console, 0, 60);
+    Movie movie;
+    movie.rom_hash = rom_file_hash(ROM);
+    console->save_state(movie.start_state);
+    for (int frame = 60; frame < 360; frame++) {
+        movie.record(buttons_at(frame), 0);
+        run(*console, frame, 1);
+    }
+    uint64_t recorded = console->frame_hash();
+
+    char path[] = "/tmp/state_tests_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        detail = "can't make a temporary file";
+        return false;
+    }
+    close(fd);
+    Movie loaded;
+    bool saved = movie.save(path) && loaded.load(path);
+
+    // a header claiming 2^32 - 1 frames over a single run is refused
+    // before anything is allocated for it
+    static const uint8_t HOSTILE[] = {'N', 'E', 'S', 'M', 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0x7F, 0, 0};
+    FILE* f = fopen(path, "wb");
+    bool written = f && fwrite(HOSTILE, 1, sizeof(HOSTILE), f) == sizeof(HOSTILE);
+    if (f) {
+        fclose(f);
+    }
+    Movie hostile;
+    bool refused = written && !hostile.load(path);
+    unlink(path);
+    if (!saved) {
+        detail = "movie didn't save and load";
+        return false;
+    }
+    if (!refused) {
+        detail = "a movie with an impossible frame count loaded";
+        return false;
+    }
+    if (loaded.rom_hash != movie.rom_hash || loaded.start_state != movie.start_state ||
+        loaded.frames != movie.frames) {
+        detail = "loaded movie differs from the recording";
+        return false;
+    }
+
+    std::unique_ptr<Console> player = power_on();
+    if (!player || !player->load_state(loaded.start_state.data(), loaded.start_state.size())) {
+        detail = "start state didn't load";
+        return false;
+    }
+    for (size_t frame = 0; frame < loaded.length(); frame++) {
+        player->set_buttons(loaded.player1(frame), loaded.player2(frame));
+        player->run_frame();
+    }
+    if (player->frame_hash() != recorded) {
+        detail = "playback ends on a different frame";
+        return false;
+    }
+    return true;
+}
+
+// copy_state_from forks the machine on the same game, also from a console
+// that read the file on its own, and refuses another game of the same size
+static bool fork_same_game_only(std::string& detail) {
+    std::unique_ptr<Console> console = power_on();
+    std::unique_ptr<Console> other = power_on();
+    std::unique_ptr<Console> kong(new Console());
+    std::unique_ptr<Console> nestest(new Console());
+    if (!console || !other || !kong->load_rom("testing/Donkey_Kong.nes") ||
+        !nestest->load_rom("testing/nestest.nes")) {
+        detail = "can't load the ROMs";
+        return false;
+    }
+    run(*console, 0, 120);
+
+    std::unique_ptr<Console> child = console->clone();
+    if (!child || !other->copy_state_from(*console)) {
+        detail = "fork on the same game refused";
+        return false;
+    }
+    run(*console, 120, 30);
+    run(*child, 120, 30);
+    run(*other, 120, 30);
+    if (child->frame_hash() != console->frame_hash() || other->frame_hash() != console->frame_hash()) {
+        detail = "forks went a different way";
+        return false;
+    }
+
+    // both NROM with 16K PRG and 8K CHR
+    std::vector<uint8_t> before, after;
+    nestest->save_state(before);
+    if (nestest->copy_state_from(*kong)) {
+        detail = "copied state between two different games";
+        return false;
+    }
+    nestest->save_state(after);
+    if (after != before) {
+        detail = "a refused copy changed the machine";
+        return false;
+    }
+    return true;
+}
+
+static uint64_t fnv(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// BatchEnv on several threads sees exactly what the same actions give on
+// consoles run one after another (RAM, grayscale frames and frame counts,
+// hashed per console), resets included. A ROM it can't run is refused.
+static bool batch_env_matches_serial(std::string& detail) {
+    if (BatchEnv::create(nullptr, 4) || BatchEnv::create(RomImage::load("testing/test_ppu_read_buffer.nes"), 4)) {
+        detail = "created a batch without a runnable ROM";
+        return false;
+    }
+
+    const size_t COUNT = 6;
+    const int SCALE = 2;
+    std::shared_ptr<const RomImage> rom = RomImage::load(ROM);
+    std::unique_ptr<BatchEnv> batch = BatchEnv::create(rom, COUNT, 3, SCALE);
+    if (!batch) {
+        detail = "can't create the batch";
+        return false;
+    }
+    std::vector<uint8_t> ram(COUNT * BatchEnv::RAM_BYTES);
+    std::vector<uint8_t> frames(COUNT * batch->frame_bytes());
+    std::vector<uint64_t> counts(COUNT);
+    batch->set_outputs(ram.data(), frames.data(), counts.data());
+
+    std::unique_ptr<Console> power_on(new Console());
+    power_on->load_rom(rom);
+    std::vector<std::unique_ptr<Console>> serial;
+    for (size_t i = 0; i < COUNT; i++) {
+        serial.emplace_back(new Console());
+        serial[i]->load_rom(rom);
+        serial[i]->get_ppu().enableGrayOutput(SCALE);
+        serial[i]->get_ppu().setRenderMode(RENDER_GRAY);
+        serial[i]->get_apu().set_muted(true);
+    }
+
+    std::vector<uint64_t> batch_hash(COUNT, 1469598103934665603ULL);
+    std::vector<uint64_t> serial_hash(COUNT, 1469598103934665603ULL);
+    uint8_t actions[COUNT];
+    for (int step = 0; step < 200; step++) {
+        if (step == 120) {
+            batch->reset(2);
+            serial[2]->copy_state_from(*power_on);
+        }
+        for (size_t i = 0; i < COUNT; i++) {
+            actions[i] = buttons_at(step + (int)i * 7) ^ (uint8_t)((step / 11 + i) & BUTTON_LEFT);
+        }
+        batch->step(actions, COUNT);
+
+        for (size_t i = 0; i < COUNT; i++) {
+            Console& c = *serial[i];
+            c.set_buttons(actions[i], 0);
+            c.run_frame();
+            uint64_t count = c.get_ppu().getFrame();
+            serial_hash[i] = fnv(serial_hash[i], c.get_cpu().get_ram(), BatchEnv::RAM_BYTES);
+            serial_hash[i] = fnv(serial_hash[i], c.get_ppu().grayFrame(), batch->frame_bytes());
+            serial_hash[i] = fnv(serial_hash[i], (const uint8_t*)&count, sizeof(count));
+
+            batch_hash[i] = fnv(batch_hash[i], &ram[i * BatchEnv::RAM_BYTES], BatchEnv::RAM_BYTES);
+            batch_hash[i] = fnv(batch_hash[i], &frames[i * batch->frame_bytes()], batch->frame_bytes());
+            batch_hash[i] = fnv(batch_hash[i], (const uint8_t*)&counts[i], sizeof(counts[i]));
+        }
+    }
+    for (size_t i = 0; i < COUNT; i++) {
+        if (batch_hash[i] != serial_hash[i]) {
+            detail = "console " + std::to_string(i) + " differs from the serial run";
+            return false;
+        }
+    }
+    return true;
+}
+
+struct StateTest {
+    const char* name;
+    bool (*run)(std::string& detail);
+};
+
+static const StateTest TESTS[] = {
+    {"savestate_round_trip", savestate_round_trip},
+    {"savestate_rejects_bad", savestate_rejects_bad},
+    {"rewind_steps_back", rewind_steps_back},
+    {"movie_round_trip", movie_round_trip},
+    {"fork_same_game_only", fork_same_game_only},
+    {"batch_env_matches_serial", batch_env_matches_serial},
+};
+
+int main() {
+    int failed = 0;
+    for (const StateTest& test : TESTS) {
+        std::string detail;
+        bool ok = test.run(detail);
+        printf("%-26s %s%s%s\n", test.name, ok ? "pass" : "FAIL", detail.empty() ? "" : "  ", detail.c_str());
+        failed += ok ? 0 : 1;
+    }
+    int count = (int)(sizeof(TESTS) / sizeof(TESTS[0]));
+    printf("%d passed, %d failed\n", count - failed, failed);
+    return failed ? 1 : 0;
+}
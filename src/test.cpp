@@ -1,8 +1,15 @@
 #include <SDL2/SDL.h>
 #include <signal.h>
-#include "cpu.h"
-#include "ppu.h"
-#include "input.h"
+#include <cmath>
+#include <cstring>
+#include "console.h"
+#include "pacer.h"
+#include "rewind.h"
+#include "movie.h"
+#include "rollback.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 
 
@@ -11,38 +18,312 @@ void handle_exit(int) {
     exit(0);
 }
 
-int main() {
-    CPU* cpu;
-    PPU* ppu;
-    Input* input;
-
-    // create instances of cpu, ppu, and input
-    ppu = new PPU();
-    cpu = new CPU();
-    input = new Input();
-
-    // Load ROM
-    cpu->loadROM("testing/legend_of_zelda.nes");
-    if (!cpu->mapper) {
-        fprintf(stderr, "CPU mapper is null. Mapper might not be implemented.\n");
-    } 
-
-    // connect all units to each other
-    ppu->connectMapper(cpu->mapper);
-    ppu->connectCPU(cpu);
-    ppu->connectInput(input);
-    cpu->connectPPU(ppu);
-    cpu->connectInput(input);
-
-    // Initialize opcode table
-    cpu->init_opcode_table();
-    
+// SDL audio thread: drain the APU's ring, holding the last sample on underrun
+// so a late frame doesn't click
+static void audio_callback(void* userdata, Uint8* stream, int len) {
+    static int16_t last = 0;
+    AudioRing* ring = (AudioRing*)userdata;
+    int16_t* out = (int16_t*)stream;
+    size_t count = len / sizeof(int16_t);
+
+    size_t got = ring->read(out, count);
+    if (got > 0) {
+        last = out[got - 1];
+    }
+    for (size_t i = got; i < count; i++) {
+        out[i] = last;
+    }
+}
+
+// Keyboard layout for both controllers
+static uint8_t keyboard_player1(const Uint8* keys) {
+    uint8_t buttons = 0;
+    if (keys[SDL_SCANCODE_Z]) buttons |= BUTTON_A;
+    if (keys[SDL_SCANCODE_X]) buttons |= BUTTON_B;
+    if (keys[SDL_SCANCODE_RSHIFT]) buttons |= BUTTON_SELECT;
+    if (keys[SDL_SCANCODE_RETURN]) buttons |= BUTTON_START;
+    if (keys[SDL_SCANCODE_UP]) buttons |= BUTTON_UP;
+    if (keys[SDL_SCANCODE_DOWN]) buttons |= BUTTON_DOWN;
+    if (keys[SDL_SCANCODE_LEFT]) buttons |= BUTTON_LEFT;
+    if (keys[SDL_SCANCODE_RIGHT]) buttons |= BUTTON_RIGHT;
+    return buttons;
+}
+
+static uint8_t keyboard_player2(const Uint8* keys) {
+    uint8_t buttons = 0;
+    if (keys[SDL_SCANCODE_V]) buttons |= BUTTON_A;
+    if (keys[SDL_SCANCODE_C]) buttons |= BUTTON_B;
+    if (keys[SDL_SCANCODE_Q]) buttons |= BUTTON_SELECT;
+    if (keys[SDL_SCANCODE_E]) buttons |= BUTTON_START;
+    if (keys[SDL_SCANCODE_W]) buttons |= BUTTON_UP;
+    if (keys[SDL_SCANCODE_S]) buttons |= BUTTON_DOWN;
+    if (keys[SDL_SCANCODE_A]) buttons |= BUTTON_LEFT;
+    if (keys[SDL_SCANCODE_D]) buttons |= BUTTON_RIGHT;
+    return buttons;
+}
+
+// F5 writes the machine to path, F7 reads it back
+static void save_state_file(const std::string& path, Console& console) {
+    std::vector<uint8_t> state;
+    console.save_state(state);
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(state.data(), 1, state.size(), f) != state.size()) {
+        fprintf(stderr, "couldn't write state to %s\n", path.c_str());
+    }
+    else {
+        printf("saved state to %s (%zu bytes)\n", path.c_str(), state.size());
+    }
+    if (f) fclose(f);
+}
+
+static bool load_state_file(const std::string& path, Console& console) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        fprintf(stderr, "no state at %s\n", path.c_str());
+        return false;
+    }
+    std::vector<uint8_t> state;
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        state.insert(state.end(), chunk, chunk + got);
+    }
+    fclose(f);
+
+    if (!console.load_state(state.data(), state.size())) {
+        fprintf(stderr, "%s isn't a state for this game\n", path.c_str());
+        return false;
+    }
+    printf("loaded state from %s\n", path.c_str());
+    return true;
+}
+
+// Replay a movie as fast as possible with no window or audio device, for
+// reproducing bug reports and as a fixed benchmark workload. The hash of the
+// last frame tells whether two runs (or two builds) agree.
+static int play_headless(Console& console, const Movie& movie, RenderMode mode) {
+    console.get_ppu().setRenderMode(mode);
+    console.get_apu().set_muted(true);
+    auto start = FramePacer::clock::now();
+    for (size_t frame = 0; frame < movie.length(); frame++) {
+        console.set_buttons(movie.player1(frame), movie.player2(frame));
+        console.run_frame();
+    }
+    console.framebuffer(); // the clock stops once the last deferred lines are drawn
+    double seconds = std::chrono::duration<double>(FramePacer::clock::now() - start).count();
+    uint64_t hash = console.frame_hash();
+
+    printf("played %zu frames in %.3f s (%.1f fps), last frame %016llx\n", movie.length(), seconds,
+           seconds > 0 ? movie.length() / seconds : 0.0, (unsigned long long)hash);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // command line: [--vsync] [--fast-forward] [--frameskip N] [--bg-cache] [--render-threads N]
+    //               [--audio-taps N] [--nes-filter] [--rewind-mb N] [--rewind-interval N]
+    //               [--run-ahead N] [--record movie] [--play movie [--headless]]
+    //               [--netplay LOCALPORT:HOST:PORT [--player N] [--input-delay N]] [--mmap-rom] [rom.nes]
+    const char* rom_path = "testing/legend_of_zelda.nes";
+    bool want_vsync = false;
+    bool fast_forward = false;
+    int frameskip = 0; // while fast-forwarding: present every Nth frame, 0 = at display rate
+    bool bg_cache = false;
+    int render_threads = 0; // > 0 draws frames on worker threads from the PPU's write log
+    int audio_taps = 16;    // resampler FIR length, 8-32
+    bool nes_filter = false;
+    int rewind_mb = 20;      // rewind history size, 0 turns rewind off
+    int rewind_interval = 1; // frames between rewind snapshots
+    int run_ahead = 0;       // frames to run ahead of the displayed picture
+    const char* record_path = nullptr; // record an input movie from power on
+    const char* play_path = nullptr;   // play an input movie
+    bool headless = false;             // play without window or audio, uncapped
+    const char* netplay_spec = nullptr; // LOCALPORT:HOST:PORT of a rollback netplay peer
+    int netplay_player = 1;
+    int input_delay = 1;
+    bool mmap_rom = false; // map the ROM file instead of reading it
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--vsync") == 0) {
+            want_vsync = true;
+        }
+        else if (strcmp(argv[i], "--fast-forward") == 0) {
+            fast_forward = true;
+        }
+        else if (strcmp(argv[i], "--bg-cache") == 0) {
+            bg_cache = true;
+        }
+        else if (strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc) {
+            render_threads = atoi(argv[++i]);
+            if (render_threads < 0) {
+                render_threads = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--audio-taps") == 0 && i + 1 < argc) {
+            audio_taps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--nes-filter") == 0) {
+            nes_filter = true;
+        }
+        else if (strcmp(argv[i], "--rewind-mb") == 0 && i + 1 < argc) {
+            rewind_mb = atoi(argv[++i]);
+            if (rewind_mb < 0) {
+                rewind_mb = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--rewind-interval") == 0 && i + 1 < argc) {
+            rewind_interval = atoi(argv[++i]);
+            if (rewind_interval < 1) {
+                rewind_interval = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            play_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--mmap-rom") == 0) {
+            mmap_rom = true;
+        }
+        else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--netplay") == 0 && i + 1 < argc) {
+            netplay_spec = argv[++i];
+        }
+        else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc) {
+            netplay_player = (atoi(argv[++i]) == 2) ? 2 : 1;
+        }
+        else if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc) {
+            input_delay = atoi(argv[++i]);
+            if (input_delay < 0) {
+                input_delay = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            run_ahead = atoi(argv[++i]);
+            if (run_ahead < 0) {
+                run_ahead = 0;
+            }
+        }
+        else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+            frameskip = atoi(argv[++i]);
+            if (frameskip < 0) {
+                frameskip = 0;
+            }
+        }
+        else {
+            rom_path = argv[i];
+        }
+    }
+
+    // the whole machine, with the ROM inserted
+    std::unique_ptr<Console> console(new Console());
+    std::shared_ptr<const RomImage> rom = mmap_rom ? RomImage::map(rom_path) : RomImage::load(rom_path);
+    if (!console->load_rom(rom)) {
+        return 1;
+    }
+    printf("PRG banks=%d CHR banks=%d mapper=%02X\n", (int)(rom->prg_size() / 16384), (int)(rom->chr_size() / 8192),
+           rom->mapper());
+    PPU* ppu = &console->get_ppu();
+    APU* apu = &console->get_apu();
+    apu->set_quality(audio_taps);
+    apu->set_filter(nes_filter ? FILTER_NES : FILTER_DC);
+    ppu->enableBackgroundCache(bg_cache);
+    ppu->enableDeferredRender(render_threads);
+    RenderMode present_mode = (render_threads > 0) ? RENDER_DEFERRED : RENDER_FULL;
+
+    // A movie starts from the state it was recorded from and only plays on
+    // the ROM it was recorded with
+    Movie movie;
+    size_t movie_frame = 0;
+    bool playing = false;
+    bool recording = false;
+    if (play_path) {
+        if (!movie.load(play_path)) {
+            fprintf(stderr, "couldn't read movie %s\n", play_path);
+            return 1;
+        }
+        if (movie.rom_hash != rom_file_hash(rom_path)) {
+            fprintf(stderr, "%s was recorded with a different ROM\n", play_path);
+            return 1;
+        }
+        if (!console->load_state(movie.start_state.data(), movie.start_state.size())) {
+            fprintf(stderr, "%s has a broken start state\n", play_path);
+            return 1;
+        }
+        playing = true;
+    }
+    else if (record_path) {
+        movie.rom_hash = rom_file_hash(rom_path);
+        console->save_state(movie.start_state);
+        recording = true;
+    }
+    if (headless) {
+        if (!playing) {
+            fprintf(stderr, "--headless needs a movie to play (--play)\n");
+            return 1;
+        }
+        return play_headless(*console, movie, present_mode);
+    }
+
+    // Rollback netplay. Both sides start from power on with the same ROM;
+    // rewind, run-ahead, movies and loading states would put the two
+    // machines out of step, so they're off.
+    UdpTransport transport;
+    std::unique_ptr<RollbackSession> netplay;
+    if (netplay_spec) {
+        unsigned local_port, remote_port;
+        char host[256];
+        if (sscanf(netplay_spec, "%u:%255[^:]:%u", &local_port, host, &remote_port) != 3) {
+            fprintf(stderr, "--netplay wants LOCALPORT:HOST:PORT\n");
+            return 1;
+        }
+        if (playing || recording) {
+            fprintf(stderr, "movies can't be used with netplay\n");
+            return 1;
+        }
+        if (!transport.open((uint16_t)local_port, host, (uint16_t)remote_port)) {
+            return 1;
+        }
+        rewind_mb = 0;
+        run_ahead = 0;
+        netplay.reset(new RollbackSession(transport, netplay_player - 1, *console, present_mode, input_delay));
+        printf("netplay: player %d, waiting for %s:%u\n", netplay_player, host, remote_port);
+    }
+
     // Setting up SDL
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
         printf("SDL_Init Error: %s\n", SDL_GetError());
         return 1;
     }
 
+    // Mono 16-bit audio pulled from the APU's ring buffer. Without a device the
+    // APU still runs (games poll $4015 and use its IRQs), its output is dropped.
+    SDL_AudioSpec want, have;
+    SDL_zero(want);
+    want.freq = 48000;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = 512;
+    want.callback = audio_callback;
+    want.userdata = &apu->output();
+    SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+
+    // The ring holds one frame of samples plus one device buffer plus a few ms
+    // of slack right after each frame is queued, about 35 ms of latency in
+    // total at 48 kHz. The device starts once that much is buffered.
+    AudioRateControl rate_control(apu->output());
+    bool audio_started = false;
+    if (audio_device == 0) {
+        printf("SDL_OpenAudioDevice Error: %s\n", SDL_GetError());
+    }
+    else {
+        apu->set_sample_rate(have.freq);
+        double target_ms = 1000.0 / NES_FRAME_HZ + 1000.0 * have.samples / have.freq + 4.0;
+        rate_control.set_target(target_ms, have.freq);
+        apu->output().set_limit(2 * rate_control.target_samples());
+    }
+
     SDL_Window* window = SDL_CreateWindow(
         "NES Emulator",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -50,87 +331,195 @@ int main() {
         SDL_WINDOW_SHOWN
     );
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // Only lock to vsync when the display runs close enough to 60.0988 Hz,
+    // otherwise the game would run at the monitor's speed
+    FramePacer pacer;
+    Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+    if (want_vsync) {
+        SDL_DisplayMode mode;
+        if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 &&
+            std::fabs(mode.refresh_rate - NES_FRAME_HZ) < 1.5) {
+            renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+            pacer.set_vsync(true);
+        }
+        else {
+            printf("Display refresh rate isn't ~60 Hz, using timer pacing instead of vsync\n");
+        }
+    }
+
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, renderer_flags);
     SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 256, 240);
     bool running = true;
     SDL_Event e;
 
     // MAIN LOOP FOR EMULATION
 
-    const int CPU_CLOCK_HZ = 1789773; // Copied this from online idk if implemented the pal version or not
-    const int CPU_CYCLES_PER_FRAME = CPU_CLOCK_HZ / 60;
- 
-    bool prevNMI = false;
-    bool currentNMI = false;
-    
+    const std::string state_path = std::string(rom_path) + ".state";
+
+    // Rewind keeps a snapshot from the start of every rewind_interval-th
+    // frame. Holding Backspace loads them newest first and replays each for
+    // one frame to show it, muted.
+    RewindBuffer rewind((size_t)rewind_mb << 20);
+    std::vector<uint8_t> rewind_state;
+    int rewind_countdown = 0;
+    std::vector<uint8_t> run_ahead_state;
+    uint64_t skipped = 0; // frames since the last present while fast-forwarding
+    FramePacer::clock::time_point last_present = FramePacer::clock::now();
+    const auto present_period = std::chrono::duration<double>(1.0 / NES_FRAME_HZ);
+    if (fast_forward) {
+        SDL_SetWindowTitle(window, "NES Emulator [fast-forward]");
+    }
+
     while (running) {
         while (SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) {
                 running = false;
             }
+            // Tab toggles uncapped fast-forward
+            if (e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_TAB) {
+                fast_forward = !fast_forward;
+                SDL_SetWindowTitle(window, fast_forward ? "NES Emulator [fast-forward]" : "NES Emulator");
+                if (!fast_forward) {
+                    pacer.resync();
+                }
+            }
+            // F5 saves a state next to the ROM, F7 loads it
+            if (e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F5) {
+                save_state_file(state_path, *console);
+            }
+            if (e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F7) {
+                if (playing || recording || netplay) {
+                    printf("can't load a state during a movie or netplay\n");
+                }
+                else {
+                    load_state_file(state_path, *console);
+                }
+            }
         }
 
-        // constantly get current key state and update
+        // constantly get current key state and update, a playing movie
+        // overrides the keyboard until it runs out
         const Uint8* keys = SDL_GetKeyboardState(NULL);
-        input->update_controller(keys);
-
+        uint8_t player1 = keyboard_player1(keys);
+        uint8_t player2 = keyboard_player2(keys);
+        if (playing) {
+            if (movie_frame < movie.length()) {
+                player1 = movie.player1(movie_frame);
+                player2 = movie.player2(movie_frame);
+                movie_frame++;
+            }
+            else {
+                printf("movie finished after %zu frames\n", movie.length());
+                playing = false;
+            }
+        }
+        if (recording) {
+            movie.record(player1, player2);
+        }
+        console->set_buttons(player1, player2);
 
-        // Simulate one frame worth of CPU cycles
-        uint64_t start_cycles = cpu->get_cycles();
-        uint64_t target_cycles = start_cycles + CPU_CYCLES_PER_FRAME;
+        // rewinding would desync a movie, it's off while one is active
+        bool rewinding = rewind_mb > 0 && !playing && !recording && keys[SDL_SCANCODE_BACKSPACE];
+        if (rewinding) {
+            if (rewind.pop(rewind_state)) {
+                console->load_state(rewind_state.data(), rewind_state.size());
+            }
+            rewind_countdown = 0;
+        }
+        else if (rewind_mb > 0 && --rewind_countdown <= 0) {
+            console->save_state(rewind_state);
+            rewind.push(rewind_state);
+            rewind_countdown = rewind_interval;
+        }
+        apu->set_muted(rewinding);
 
-        while (cpu->get_cycles() < target_cycles) {
-            uint64_t before = cpu->get_cycles();
-            cpu->step();
+        // When fast-forwarding only some frames are shown, the others
+        // run the PPU with pixel output turned off
+        bool present = true;
+        if (fast_forward) {
+            if (frameskip > 0) {
+                present = (++skipped >= (uint64_t)frameskip);
+            }
+            else {
+                present = (FramePacer::clock::now() - last_present) >= present_period;
+            }
+        }
+        // Simulate exactly one PPU frame. With run-ahead that frame is heard
+        // but not seen: the picture comes from running run_ahead more frames
+        // on the same input, muted, after which the machine is put back.
+        if (netplay) {
+            // the session runs (and when it mispredicted, re-runs) frames itself
+            netplay->advance_frame(player1);
+        }
+        else if (run_ahead > 0 && present && !rewinding) {
+            ppu->setRenderMode(RENDER_OFF);
+            console->run_frame();
+            console->save_state(run_ahead_state);
+            apu->set_muted(true);
+            for (int i = 1; i <= run_ahead; i++) {
+                ppu->setRenderMode(i == run_ahead ? present_mode : RENDER_OFF);
+                console->run_frame();
+            }
+            console->load_state(run_ahead_state.data(), run_ahead_state.size());
+            apu->set_muted(false);
+        }
+        else {
+            ppu->setRenderMode(present ? present_mode : RENDER_OFF);
+            console->run_frame();
+        }
 
-            uint64_t after = cpu->get_cycles();
-            uint64_t used = (after - before);
-            if (used == 0) {
-                used = 1;
+        // Steer the audio rate towards the target fill. Fast-forward overfills
+        // the ring on purpose (the excess is dropped) and rewinding leaves it
+        // empty, so leave the ratio alone for both.
+        if (audio_device != 0 && !fast_forward && !rewinding) {
+            apu->set_rate_ratio(rate_control.update());
+            if (!audio_started && apu->output().size() >= rate_control.target_samples()) {
+                SDL_PauseAudioDevice(audio_device, 0);
+                audio_started = true;
             }
+        }
 
-            bool pendingNMI = false;
+        if (present) {
+            // Render frame (copy framebuffer once per frame)
+            SDL_UpdateTexture(texture, nullptr, console->framebuffer(), 256 * sizeof(uint32_t));
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+            SDL_RenderPresent(renderer);
+            last_present = FramePacer::clock::now();
+            skipped = 0;
+        }
 
-            // For every CPU cycle, tick the PPU 3 times
-            for (uint64_t i = 0; i < used * 3; ++i) {
-                ppu->tick();
-                bool level = ppu->getNMI();
+        // Wait for the next frame deadline (only measures when vsync is on)
+        if (!fast_forward) {
+            pacer.wait();
+        }
+    }
 
-                if (!currentNMI && level && !prevNMI) {
-                    pendingNMI = true;
-                }
-                prevNMI = level;
+        if (recording) {
+            if (movie.save(record_path)) {
+                printf("recorded %zu frames to %s\n", movie.length(), record_path);
             }
-
-            if (pendingNMI) {
-                currentNMI = true;
-                cpu->nmi();
-                for (int i = 0; i < 21; i++) { // 7 cycles * 3 dots
-                    ppu->tick();
-                    prevNMI = ppu->getNMI();
-                }
-                currentNMI = false;
+            else {
+                fprintf(stderr, "couldn't write movie %s\n", record_path);
             }
         }
 
-        // Render frame (copy framebuffer once per frame)
-        SDL_UpdateTexture(texture, nullptr, ppu->framebuffer, 256 * sizeof(uint32_t));
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-        SDL_RenderPresent(renderer);
-
-        SDL_Delay(1);
-    }
+        pacer.print_stats();
+        if (audio_device != 0) {
+            rate_control.print_stats();
+        }
+        if (netplay) {
+            netplay->print_stats();
+        }
 
         // Clean up
+        if (audio_device != 0) {
+            SDL_CloseAudioDevice(audio_device);
+        }
         SDL_DestroyTexture(texture);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         SDL_Quit();
 
-        delete cpu;
-        delete ppu;
-        delete input;
-
         return 0;
 }
@@ -0,0 +1,61 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned threads) : running(0), stopping(false) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+    }
+    task_ready.notify_one();
+}
+
+void ThreadPool::wait_idle() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return tasks.empty() && running == 0; });
+}
+
+unsigned ThreadPool::size() const {
+    return (unsigned)workers.size();
+}
+
+void ThreadPool::worker() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        task_ready.wait(guard, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+            return; // stopping and nothing left to do
+        }
+
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        running++;
+
+        guard.unlock();
+        task();
+        guard.lock();
+
+        running--;
+        if (tasks.empty() && running == 0) {
+            idle.notify_all();
+        }
+    }
+}
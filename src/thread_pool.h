@@ -0,0 +1,32 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from one FIFO queue
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads);
+    ~ThreadPool(); // finishes queued tasks, then joins
+
+    void submit(std::function<void()> task);
+
+    // block until the queue is empty and no task is running
+    void wait_idle();
+
+    unsigned size() const;
+
+private:
+    void worker();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable task_ready;
+    std::condition_variable idle;
+    unsigned running;
+    bool stopping;
+};
@@ -0,0 +1,149 @@
+#include "trace.h"
+#include <cstring>
+#include "cpu.h"
+#include "ppu.h"
+
+// Bytes per instruction including unofficial opcodes, as nestest.log shows
+// them (BRK as 1)
+static const uint8_t INSTRUCTION_SIZE[256] = {
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    3, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    1, 2, 1, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 3, 3, 3, 3,
+    2, 2, 1, 2, 2, 2, 2, 2, 1, 3, 1, 3, 3, 3, 3, 3,
+};
+
+static const char HEX[] = "0123456789ABCDEF";
+
+static char* put_hex(char* p, uint32_t value, int digits) {
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = HEX[value & 0xF];
+        value >>= 4;
+    }
+    return p + digits;
+}
+
+// right aligned in width, like %3d
+static char* put_dec(char* p, uint64_t value, int width) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    for (int i = n; i < width; i++) {
+        *p++ = ' ';
+    }
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static char* put_text(char* p, const char* text) {
+    size_t size = strlen(text);
+    memcpy(p, text, size);
+    return p + size;
+}
+
+NestestTracer::NestestTracer(FILE* out_file, size_t buffer_bytes)
+    : out(out_file), buffer(buffer_bytes < 256 ? 256 : buffer_bytes), used(0), count(0), stop(false) {
+}
+
+NestestTracer::~NestestTracer() {
+    flush();
+}
+
+void NestestTracer::flush() {
+    if (out && used) {
+        fwrite(buffer.data(), 1, used, out);
+    }
+    used = 0;
+}
+
+void NestestTracer::instruction(CPU& cpu) {
+    if (stop) {
+        return;
+    }
+    if (buffer.size() - used < 128) {
+        flush();
+    }
+
+    char* line = buffer.data() + used;
+    char* p = line;
+    uint16_t pc = cpu.get_PC();
+    uint8_t opcode = cpu.read(pc);
+    int size = INSTRUCTION_SIZE[opcode];
+
+    p = put_hex(p, pc, 4);
+    *p++ = ' ';
+    for (int i = 0; i < 3; i++) {
+        *p++ = ' ';
+        if (i < size) {
+            // operands are read straight from memory, code doesn't run from registers
+            p = put_hex(p, i == 0 ? opcode : cpu.read((uint16_t)(pc + i)), 2);
+        }
+        else {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+    }
+    memset(p, ' ', 34);
+    p += 34; // blank disassembly column, registers start at column 48
+    p = put_text(p, "A:");
+    p = put_hex(p, cpu.get_A(), 2);
+    p = put_text(p, " X:");
+    p = put_hex(p, cpu.get_X(), 2);
+    p = put_text(p, " Y:");
+    p = put_hex(p, cpu.get_Y(), 2);
+    p = put_text(p, " P:");
+    p = put_hex(p, cpu.get_P(), 2);
+    p = put_text(p, " SP:");
+    p = put_hex(p, cpu.get_SP(), 2);
+    p = put_text(p, " PPU:");
+    p = put_dec(p, cpu.ppu->getScanline(), 3);
+    *p++ = ',';
+    p = put_dec(p, cpu.ppu->getDot(), 3);
+    p = put_text(p, " CYC:");
+    p = put_dec(p, cpu.get_cycles(), 0);
+
+    if (on_line && !on_line(line, (size_t)(p - line))) {
+        stop = true;
+        return;
+    }
+    *p++ = '\n';
+    used = (size_t)(p - buffer.data());
+    count++;
+}
+
+bool same_trace_line(const char* a, size_t a_size, const char* b, size_t b_size) {
+    // PC and bytes are the first 14 columns, registers on start at "A:"
+    if (a_size < 14 || b_size < 14 || memcmp(a, b, 14) != 0) {
+        return false;
+    }
+    const char* a_regs = nullptr;
+    const char* b_regs = nullptr;
+    for (size_t i = 14; i + 1 < a_size && !a_regs; i++) {
+        if (a[i] == 'A' && a[i + 1] == ':') a_regs = a + i;
+    }
+    for (size_t i = 14; i + 1 < b_size && !b_regs; i++) {
+        if (b[i] == 'A' && b[i + 1] == ':') b_regs = b + i;
+    }
+    if (!a_regs || !b_regs) {
+        return false;
+    }
+    size_t a_rest = a_size - (a_regs - a);
+    size_t b_rest = b_size - (b_regs - b);
+    return a_rest == b_rest && memcmp(a_regs, b_regs, a_rest) == 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+class CPU;
+
+/*
+ * Trace policies for CPU::step(Trace&), Console::step(Trace&) and
+ * Console::run_frame(Trace&). instruction() is called with the CPU before
+ * each instruction runs. The plain step()/run_frame() use NoTrace, which
+ * inlines to nothing, so the emulator pays nothing for tracing it doesn't
+ * do.
+ */
+struct NoTrace {
+    void instruction(CPU&) {}
+};
+
+/*
+ * Writes the nestest.log format, one line per instruction:
+ *
+ *   C000  4C F5 C5                                  A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+ *
+ * PC, the instruction's bytes, registers, the PPU's scanline and dot and
+ * the CPU cycle count. The disassembly column is left blank, so compare
+ * against a golden log with same_trace_line(), which skips it. Lines are
+ * collected in a large buffer and written out when it fills.
+ */
+class NestestTracer {
+public:
+    // out may be nullptr when only on_line is wanted
+    explicit NestestTracer(FILE* out, size_t buffer_bytes = 1 << 20);
+    ~NestestTracer(); // flushes
+    NestestTracer(const NestestTracer&) = delete;
+    NestestTracer& operator=(const NestestTracer&) = delete;
+
+    void instruction(CPU& cpu);
+    void flush();
+
+    // Sees each line (no newline) before it's written; returning false
+    // stops the trace, nothing after that is traced or written
+    std::function<bool(const char* line, size_t size)> on_line;
+
+    uint64_t lines() const { return count; }
+    bool stopped() const { return stop; }
+
+private:
+    FILE* out;
+    std::vector<char> buffer;
+    size_t used;
+    uint64_t count;
+    bool stop;
+};
+
+// Whether two nestest.log lines agree on everything but the disassembly
+bool same_trace_line(const char* a, size_t a_size, const char* b, size_t b_size);
@@ -0,0 +1,145 @@
+#include "transport.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+UdpTransport::UdpTransport() : fd(-1), remote_size(0) {
+}
+
+UdpTransport::~UdpTransport() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool UdpTransport::open(uint16_t local_port, const char* remote_host, uint16_t remote_port) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* found = nullptr;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", (unsigned)remote_port);
+    if (getaddrinfo(remote_host, port, &hints, &found) != 0 || !found) {
+        fprintf(stderr, "netplay: can't resolve %s\n", remote_host);
+        return false;
+    }
+    std::memcpy(remote, found->ai_addr, found->ai_addrlen);
+    remote_size = (uint32_t)found->ai_addrlen;
+    freeaddrinfo(found);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("netplay: socket");
+        return false;
+    }
+    sockaddr_in local;
+    std::memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(local_port);
+    if (bind(fd, (sockaddr*)&local, sizeof(local)) != 0) {
+        perror("netplay: bind");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+void UdpTransport::send(const uint8_t* data, size_t size) {
+    if (fd >= 0) {
+        sendto(fd, data, size, 0, (const sockaddr*)remote, remote_size);
+    }
+}
+
+bool UdpTransport::receive(std::vector<uint8_t>& packet) {
+    if (fd < 0) {
+        return false;
+    }
+    uint8_t buffer[1500];
+    sockaddr_storage from;
+    while (true) {
+        socklen_t from_size = sizeof(from);
+        ssize_t got = recvfrom(fd, buffer, sizeof(buffer), 0, (sockaddr*)&from, &from_size);
+        if (got < 0) {
+            return false; // EWOULDBLOCK, or an ICMP error from a peer that isn't up yet
+        }
+        // only the peer's packets, by address and port
+        if (from_size == remote_size && std::memcmp(&from, remote, remote_size) == 0) {
+            packet.assign(buffer, buffer + got);
+            return true;
+        }
+    }
+}
+
+struct LoopbackTransport::Link {
+    struct Packet {
+        std::chrono::steady_clock::time_point due;
+        std::vector<uint8_t> data;
+    };
+
+    std::mutex lock;
+    std::vector<Packet> queue[2]; // packets on their way to each side
+    double latency_ms;
+    double jitter_ms;
+    int loss_percent;
+    std::mt19937 random;
+};
+
+void LoopbackTransport::create_pair(std::unique_ptr<LoopbackTransport>& a, std::unique_ptr<LoopbackTransport>& b,
+                                    double latency_ms, double jitter_ms, int loss_percent, uint32_t seed) {
+    std::shared_ptr<Link> link = std::make_shared<Link>();
+    link->latency_ms = latency_ms;
+    link->jitter_ms = jitter_ms;
+    link->loss_percent = loss_percent;
+    link->random.seed(seed);
+    a.reset(new LoopbackTransport(link, 0));
+    b.reset(new LoopbackTransport(link, 1));
+}
+
+LoopbackTransport::LoopbackTransport(std::shared_ptr<Link> link_ref, int side_index)
+    : link(link_ref), side(side_index) {
+}
+
+void LoopbackTransport::send(const uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> guard(link->lock);
+    if ((int)(link->random() % 100) < link->loss_percent) {
+        return;
+    }
+    double delay = link->latency_ms;
+    if (link->jitter_ms > 0) {
+        delay += std::uniform_real_distribution<double>(0, link->jitter_ms)(link->random);
+    }
+    auto due = std::chrono::steady_clock::now() +
+               std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(delay));
+    link->queue[1 - side].push_back({due, std::vector<uint8_t>(data, data + size)});
+}
+
+bool LoopbackTransport::receive(std::vector<uint8_t>& packet) {
+    std::lock_guard<std::mutex> guard(link->lock);
+    std::vector<Link::Packet>& queue = link->queue[side];
+    auto now = std::chrono::steady_clock::now();
+
+    // the earliest packet that has arrived
+    size_t best = queue.size();
+    for (size_t i = 0; i < queue.size(); i++) {
+        if (queue[i].due <= now && (best == queue.size() || queue[i].due < queue[best].due)) {
+            best = i;
+        }
+    }
+    if (best == queue.size()) {
+        return false;
+    }
+    packet.swap(queue[best].data);
+    queue.erase(queue.begin() + best);
+    return true;
+}
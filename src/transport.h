@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Unreliable datagram link to one netplay peer. Packets can be lost,
+ * duplicated or reordered; RollbackSession resends what hasn't been
+ * acknowledged, so nothing here retries. Both calls are non-blocking.
+ */
+class Transport {
+public:
+    virtual ~Transport() = default;
+    virtual void send(const uint8_t* data, size_t size) = 0;
+    virtual bool receive(std::vector<uint8_t>& packet) = 0; // false when nothing is waiting
+};
+
+// UDP socket bound to a local port, talking to one remote address (POSIX)
+class UdpTransport : public Transport {
+public:
+    UdpTransport();
+    ~UdpTransport() override;
+    UdpTransport(const UdpTransport&) = delete;
+    UdpTransport& operator=(const UdpTransport&) = delete;
+
+    // false (with a message on stderr) if the port is taken or the host
+    // doesn't resolve
+    bool open(uint16_t local_port, const char* remote_host, uint16_t remote_port);
+
+    void send(const uint8_t* data, size_t size) override;
+    bool receive(std::vector<uint8_t>& packet) override;
+
+private:
+    int fd;
+    uint8_t remote[128]; // sockaddr of the peer
+    uint32_t remote_size;
+};
+
+/*
+ * In-process link for testing: two ends where a packet sent on one shows up
+ * on the other after latency_ms (plus up to jitter_ms, which also reorders
+ * packets), and loss_percent of packets never arrive. The random choices
+ * come from a fixed seed so a test run can be repeated.
+ */
+class LoopbackTransport : public Transport {
+public:
+    static void create_pair(std::unique_ptr<LoopbackTransport>& a, std::unique_ptr<LoopbackTransport>& b,
+                            double latency_ms, double jitter_ms = 0, int loss_percent = 0, uint32_t seed = 1);
+
+    void send(const uint8_t* data, size_t size) override;
+    bool receive(std::vector<uint8_t>& packet) override;
+
+private:
+    struct Link;
+    LoopbackTransport(std::shared_ptr<Link> link, int side);
+
+    std::shared_ptr<Link> link;
+    int side;
+};
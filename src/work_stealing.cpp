@@ -0,0 +1,112 @@
+#include "work_stealing.h"
+
+// the pool and queue of the worker running on this thread, if any
+static thread_local WorkStealingPool* current_pool = nullptr;
+static thread_local unsigned current_index = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+    : queued(0), pending(0), next_queue(0), steal_count(0), stopping(false) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        queues.emplace_back(new Queue());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&WorkStealingPool::worker, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    unsigned index;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending++;
+        if (current_pool == this) {
+            index = current_index;
+        }
+        else {
+            index = next_queue;
+            next_queue = (next_queue + 1) % queues.size();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queued++;
+    }
+    task_ready.notify_one();
+}
+
+void WorkStealingPool::wait_idle() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return pending == 0; });
+}
+
+// Newest task of our own queue, else the oldest of the next queue that has one
+bool WorkStealingPool::take(unsigned index, std::function<void()>& task) {
+    for (unsigned n = 0; n < queues.size(); n++) {
+        unsigned victim = (index + n) % queues.size();
+        Queue& q = *queues[victim];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty()) {
+            continue;
+        }
+        if (n == 0) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            steal_count++;
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::worker(unsigned index) {
+    current_pool = this;
+    current_index = index;
+
+    std::function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            task();
+            task = nullptr; // free what it captured before saying it's done
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (--pending == 0) {
+                idle.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        task_ready.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping && queued <= 0) {
+            return; // stopping and nothing left to do
+        }
+    }
+}
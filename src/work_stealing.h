@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Worker threads with a task queue each. A worker runs its own queue
+ * newest first and, when that's empty, steals the oldest task of another
+ * worker's queue, so a worker stuck on long tasks has its backlog taken by
+ * the ones that ran out. Tasks submitted from inside a task go to the
+ * submitting worker's queue, others are dealt round robin.
+ *
+ * For jobs of very uneven length; ThreadPool's single FIFO is simpler when
+ * the tasks are small and alike.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads); // 0 = one per core
+    ~WorkStealingPool(); // finishes queued tasks, then joins
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void submit(std::function<void()> task);
+
+    // block until every submitted task has finished
+    void wait_idle();
+
+    unsigned size() const { return (unsigned)workers.size(); }
+    uint64_t steals() const { return steal_count; } // tasks run by a worker other than their queue's
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void worker(unsigned index);
+    bool take(unsigned index, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    // sleeping and finishing; queued is only raised under lock so a worker
+    // can't miss a task it's about to sleep through
+    std::mutex lock;
+    std::condition_variable task_ready;
+    std::condition_variable idle;
+    std::atomic<int> queued;  // tasks sitting in queues
+    unsigned pending;         // submitted and not finished
+    unsigned next_queue;      // round robin for outside submits
+    std::atomic<uint64_t> steal_count;
+    bool stopping;
+};